@@ -0,0 +1,237 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "WebSocketClient.h"
+#include "WebSocketRecorder.h"
+
+// Latency is measured from a send to the next reply on the same connection, so it is only
+// meaningful against a server that answers every message once (like poca-ws-server).
+class ReplayConnection : public poca_ws::WebSocketClientListener {
+public:
+    virtual void OnBinary(uint8_t* data, int len) override { OnReply(); }
+    virtual void OnText(std::string& msg) override { OnReply(); }
+    virtual void OnClosed() override {}
+
+    void Sent() {
+        std::unique_lock<std::mutex> lck(mux_);
+        in_flight_.push_back(std::chrono::steady_clock::now());
+    }
+
+    void TakeLatencies(std::vector<int64_t>& latencies) {
+        std::unique_lock<std::mutex> lck(mux_);
+        latencies.insert(latencies.end(), latencies_us_.begin(), latencies_us_.end());
+    }
+
+    int64_t InFlight() {
+        std::unique_lock<std::mutex> lck(mux_);
+        return in_flight_.size();
+    }
+
+    poca_ws::WebSocketClient* ws_client = nullptr;
+
+private:
+    void OnReply() {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (in_flight_.empty()) return;
+        auto latency = std::chrono::steady_clock::now() - in_flight_.front();
+        in_flight_.pop_front();
+        latencies_us_.push_back(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+    }
+
+    std::mutex mux_;
+    std::deque<std::chrono::steady_clock::time_point> in_flight_;
+    std::vector<int64_t> latencies_us_;
+};
+
+static void Usage(const char* name) {
+    printf("usage: %s <capture[,capture...]> <addr> <port> [connections=1] [speed=1.0, 0 for max]\n", name);
+    printf("a capture written by WebSocketServerGroup is found as <capture>.0, <capture>.1, ...\n");
+}
+
+static bool FileExists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static std::vector<std::string> CapturePaths(const std::string& arg) {
+    std::vector<std::string> paths;
+    size_t begin = 0;
+    while (begin <= arg.size()) {
+        size_t end = arg.find(',', begin);
+        if (end == std::string::npos) end = arg.size();
+        std::string path = arg.substr(begin, end - begin);
+        if (!path.empty()) {
+            if (!FileExists(path) && FileExists(path + ".0")) {
+                for (int i = 0; FileExists(path + "." + std::to_string(i)); ++i) {
+                    paths.push_back(path + "." + std::to_string(i));
+                }
+            } else {
+                paths.push_back(path);
+            }
+        }
+        begin = end + 1;
+    }
+    return paths;
+}
+
+// merges several captures, e.g. one per shard, into a single stream ordered by ts_ns. Only
+// captures of one process share a time origin
+class CaptureMerger {
+public:
+    ~CaptureMerger() {
+        for (auto& source : sources_) delete source.reader;
+    }
+
+    int Open(const std::vector<std::string>& paths) {
+        for (auto& path : paths) {
+            Source source;
+            source.reader = new poca_ws::WebSocketCaptureReader();
+            if (source.reader->Open(path) != 0) {
+                printf("open capture %s failed\n", path.c_str());
+                delete source.reader;
+                return -1;
+            }
+            source.valid = source.reader->Next(source.header, source.payload);
+            if (source.valid && (start_ns_ < 0 || source.header.ts_ns < start_ns_)) {
+                start_ns_ = source.header.ts_ns;
+            }
+            sources_.push_back(source);
+        }
+        return sources_.empty() ? -1 : 0;
+    }
+
+    // ts_ns of the first message, replay times are relative to it
+    int64_t GetStartNs() { return start_ns_ < 0 ? 0 : start_ns_; }
+
+    bool Next(poca_ws::CaptureRecordHeader& header, uint8_t*& payload) {
+        Source* next = nullptr;
+        for (auto& source : sources_) {
+            if (source.valid && (next == nullptr || source.header.ts_ns < next->header.ts_ns)) {
+                next = &source;
+            }
+        }
+        if (next == nullptr) return false;
+        header = next->header;
+        payload = next->payload;
+        next->valid = next->reader->Next(next->header, next->payload);
+        return true;
+    }
+
+private:
+    struct Source {
+        poca_ws::WebSocketCaptureReader* reader;
+        poca_ws::CaptureRecordHeader header;
+        uint8_t* payload = nullptr;
+        bool valid = false;
+    };
+    std::vector<Source> sources_;
+    int64_t start_ns_ = -1;
+};
+
+static int64_t Percentile(std::vector<int64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)(sorted.size() * p / 100.0);
+    if (idx >= sorted.size()) idx = sorted.size() - 1;
+    return sorted[idx];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        Usage(argv[0]);
+        return 1;
+    }
+    std::string capture = argv[1];
+    std::string addr = argv[2];
+    int port = atoi(argv[3]);
+    int conn_num = argc > 4 ? atoi(argv[4]) : 1;
+    double speed = argc > 5 ? atof(argv[5]) : 1.0;
+    if (conn_num < 1) conn_num = 1;
+
+    CaptureMerger reader;
+    if (reader.Open(CapturePaths(capture)) != 0) {
+        printf("open capture %s failed\n", capture.c_str());
+        return 1;
+    }
+
+    std::vector<ReplayConnection*> conns;
+    for (int i = 0; i < conn_num; ++i) {
+        ReplayConnection* conn = new ReplayConnection();
+        conn->ws_client = new poca_ws::WebSocketClient(*conn);
+        if (conn->ws_client->Connect(addr, port) != 0) {
+            printf("connect %s:%d failed\n", addr.c_str(), port);
+            return 1;
+        }
+        conns.push_back(conn);
+    }
+
+    // recorded connections are spread over the replay connections in order of first appearance
+    std::map<int64_t, ReplayConnection*> user_conns;
+    poca_ws::CaptureRecordHeader header;
+    uint8_t* payload;
+    int64_t messages = 0, bytes = 0;
+    int64_t start_ns = reader.GetStartNs();
+    auto start = std::chrono::steady_clock::now();
+    while (reader.Next(header, payload)) {
+        if (speed > 0) {
+            int64_t offset_ns = (int64_t)((header.ts_ns - start_ns) / speed);
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(offset_ns));
+        }
+        auto it = user_conns.find(header.user_id);
+        if (it == user_conns.end()) {
+            it = user_conns.emplace(header.user_id, conns[user_conns.size() % conns.size()]).first;
+        }
+        ReplayConnection* conn = it->second;
+        conn->Sent();
+        if (header.type == poca_ws::CaptureBinary) {
+            conn->ws_client->SendBinary(payload, header.len);
+        } else {
+            std::string msg((char*)payload, header.len);
+            conn->ws_client->SendMessage(msg);
+        }
+        messages++;
+        bytes += header.len;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // give outstanding replies a moment to arrive
+    for (int i = 0; i < 100; ++i) {
+        int64_t in_flight = 0;
+        for (auto conn : conns) in_flight += conn->InFlight();
+        if (in_flight == 0) break;
+        usleep(10 * 1000);
+    }
+
+    std::vector<int64_t> latencies;
+    for (auto conn : conns) {
+        conn->TakeLatencies(latencies);
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("replayed %lld messages, %lld bytes over %d connections in %.3f s\n", (long long)messages,
+           (long long)bytes, conn_num, elapsed);
+    if (elapsed > 0) {
+        printf("throughput: %.1f msg/s, %.3f MB/s\n", messages / elapsed, bytes / elapsed / (1 << 20));
+    }
+    printf("latency(us) replies: %d, p50: %lld, p90: %lld, p99: %lld, p999: %lld, max: %lld\n",
+           (int)latencies.size(), (long long)Percentile(latencies, 50), (long long)Percentile(latencies, 90),
+           (long long)Percentile(latencies, 99), (long long)Percentile(latencies, 99.9),
+           (long long)(latencies.empty() ? 0 : latencies.back()));
+
+    for (auto conn : conns) {
+        conn->ws_client->Disconnect();
+    }
+    usleep(100 * 1000);
+    poca_ws::WebSocketClient::CloseAll();
+    return 0;
+}
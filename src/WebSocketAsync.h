@@ -0,0 +1,127 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define POCA_WS_COROUTINE 1
+#endif
+#endif
+
+namespace poca_ws {
+    enum { AsyncText = 1, AsyncBinary, AsyncClosed };
+
+    struct AsyncMessage {
+        int type = AsyncClosed;
+        std::string data;
+    };
+
+    // Result of an asynchronous operation, completed once by a library thread. Continuations
+    // run on the completing thread, which is one of the service threads, so they must not block.
+    // Copies share the same state.
+    template <typename T>
+    class AsyncResult {
+    public:
+        AsyncResult() : state_(std::make_shared<State>()) {}
+
+        static AsyncResult Ready(T value) {
+            AsyncResult result;
+            result.Set(std::move(value));
+            return result;
+        }
+
+        void Set(T value) {
+            std::vector<std::function<void(void)>> thens;
+            {
+                std::unique_lock<std::mutex> lck(state_->mux);
+                if (state_->ready) return;
+                state_->value = std::move(value);
+                state_->ready = true;
+                thens.swap(state_->thens);
+            }
+            state_->cv.notify_all();
+            for (auto& then : thens) {
+                then();
+            }
+        }
+
+        bool IsReady() {
+            std::unique_lock<std::mutex> lck(state_->mux);
+            return state_->ready;
+        }
+
+        // blocks the caller, for code that is not itself driven by a continuation
+        T Get() {
+            std::unique_lock<std::mutex> lck(state_->mux);
+            state_->cv.wait(lck, [&]() { return state_->ready; });
+            return state_->value;
+        }
+
+        // fn runs inline when the result is already complete, otherwise after the continuations
+        // added before it
+        void Then(std::function<void(T&)> fn) {
+            std::shared_ptr<State> state = state_;
+            if (!Subscribe([state, fn]() { fn(state->value); })) {
+                fn(state_->value);
+            }
+        }
+
+        // returns false, without keeping fn, when the result is already complete
+        bool Subscribe(std::function<void(void)> fn) {
+            std::unique_lock<std::mutex> lck(state_->mux);
+            if (state_->ready) return false;
+            state_->thens.push_back(std::move(fn));
+            return true;
+        }
+
+    private:
+        struct State {
+            std::mutex mux;
+            std::condition_variable cv;
+            bool ready = false;
+            T value;
+            std::vector<std::function<void(void)>> thens;
+        };
+        std::shared_ptr<State> state_;
+    };
+
+#ifdef POCA_WS_COROUTINE
+    // co_await on an AsyncResult resumes the coroutine on the thread that completes it
+    template <typename T>
+    struct AsyncAwaiter {
+        AsyncResult<T> result;
+
+        bool await_ready() { return result.IsReady(); }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return result.Subscribe([handle]() { handle.resume(); });
+        }
+        T await_resume() { return result.Get(); }
+    };
+
+    template <typename T>
+    AsyncAwaiter<T> operator co_await(AsyncResult<T> result) {
+        return AsyncAwaiter<T>{result};
+    }
+
+    // fire and forget coroutine type for sessions, the frame is freed when the body returns
+    struct AsyncTask {
+        struct promise_type {
+            AsyncTask get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+#endif
+}  // namespace poca_ws
+#endif
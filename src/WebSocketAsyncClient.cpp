@@ -0,0 +1,156 @@
+#include "WebSocketAsyncClient.h"
+
+namespace poca_ws {
+    WebSocketAsyncClient::WebSocketAsyncClient(int send_watermark, int inbox_limit)
+        : send_watermark_(send_watermark), inbox_limit_(inbox_limit) {
+        client_ = new WebSocketClient(*this);
+        client_->SetWriteCallback([this](int pending) { OnWritten(pending); });
+    }
+
+    WebSocketAsyncClient::~WebSocketAsyncClient() { delete client_; }
+
+    AsyncResult<int> WebSocketAsyncClient::Connect(std::string addr, int port, std::string path) {
+        AsyncResult<int> result;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            connected_ = false;
+            closed_ = false;
+            inbox_.clear();
+            if (receive_paused_) {
+                receive_paused_ = false;
+                client_->PauseReceive(false);
+            }
+            connect_result_ = result;
+        }
+        if (client_->Connect(addr, port, path) != 0) {
+            result.Set(-1);
+        }
+        return result;
+    }
+
+    void WebSocketAsyncClient::Disconnect() { client_->Disconnect(); }
+
+    AsyncResult<AsyncMessage> WebSocketAsyncClient::Receive() {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (!inbox_.empty()) {
+            AsyncMessage msg = std::move(inbox_.front());
+            inbox_.pop_front();
+            if (receive_paused_ && (int)inbox_.size() <= inbox_limit_ / 2) {
+                receive_paused_ = false;
+                client_->PauseReceive(false);
+            }
+            return AsyncResult<AsyncMessage>::Ready(std::move(msg));
+        }
+        if (closed_) {
+            return AsyncResult<AsyncMessage>::Ready(AsyncMessage());
+        }
+        AsyncResult<AsyncMessage> result;
+        receivers_.push_back(result);
+        return result;
+    }
+
+    AsyncResult<int> WebSocketAsyncClient::Send(std::string msg) {
+        return SendFrame(AsyncText, (const uint8_t*)msg.data(), (int)msg.size());
+    }
+
+    AsyncResult<int> WebSocketAsyncClient::SendBinary(const uint8_t* data, int len) {
+        return SendFrame(AsyncBinary, data, len);
+    }
+
+    AsyncResult<int> WebSocketAsyncClient::SendFrame(int type, const uint8_t* data, int len) {
+        // kept locked up to the pending check so a write in between cannot be missed by OnWritten
+        std::unique_lock<std::mutex> lck(mux_);
+        if (!connected_) {
+            return AsyncResult<int>::Ready(-1);
+        }
+        int ret;
+        if (type == AsyncBinary) {
+            ret = client_->SendBinary((uint8_t*)data, len);
+        } else {
+            std::string msg((const char*)data, len);
+            ret = client_->SendMessage(msg);
+        }
+        if (ret != 0 || client_->GetPendingSendNum() <= send_watermark_) {
+            return AsyncResult<int>::Ready(ret);
+        }
+        AsyncResult<int> result;
+        senders_.push_back(result);
+        return result;
+    }
+
+    void WebSocketAsyncClient::OnWritten(int pending) {
+        if (pending > send_watermark_) return;
+        std::deque<AsyncResult<int>> senders;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            senders.swap(senders_);
+        }
+        for (auto& sender : senders) {
+            sender.Set(0);
+        }
+    }
+
+    void WebSocketAsyncClient::Deliver(AsyncMessage& msg) {
+        AsyncResult<AsyncMessage> receiver;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            if (receivers_.empty()) {
+                inbox_.push_back(std::move(msg));
+                if (inbox_limit_ > 0 && !receive_paused_ && (int)inbox_.size() >= inbox_limit_) {
+                    // pause and resume are both requested under mux_, so they reach the client in order
+                    receive_paused_ = true;
+                    client_->PauseReceive(true);
+                }
+                return;
+            }
+            receiver = receivers_.front();
+            receivers_.pop_front();
+        }
+        receiver.Set(std::move(msg));
+    }
+
+    void WebSocketAsyncClient::OnBinary(uint8_t* data, int len) {
+        AsyncMessage msg;
+        msg.type = AsyncBinary;
+        msg.data.assign((char*)data, len);
+        Deliver(msg);
+    }
+
+    void WebSocketAsyncClient::OnText(std::string& text) {
+        AsyncMessage msg;
+        msg.type = AsyncText;
+        msg.data = text;
+        Deliver(msg);
+    }
+
+    void WebSocketAsyncClient::OnConnected() {
+        AsyncResult<int> result;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            connected_ = true;
+            result = connect_result_;
+        }
+        result.Set(0);
+    }
+
+    void WebSocketAsyncClient::OnClosed() {
+        AsyncResult<int> connect_result;
+        std::deque<AsyncResult<AsyncMessage>> receivers;
+        std::deque<AsyncResult<int>> senders;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            connected_ = false;
+            closed_ = true;
+            connect_result = connect_result_;
+            receivers.swap(receivers_);
+            senders.swap(senders_);
+        }
+        connect_result.Set(-1);
+        for (auto& receiver : receivers) {
+            receiver.Set(AsyncMessage());
+        }
+        for (auto& sender : senders) {
+            sender.Set(-1);
+        }
+    }
+}  // namespace poca_ws
@@ -0,0 +1,58 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_CLIENT_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_CLIENT_H
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "WebSocketAsync.h"
+#include "WebSocketClient.h"
+#include "WebSocketClientListener.h"
+
+namespace poca_ws {
+    // Awaitable WebSocketClient: results complete on the client service thread, so any number of
+    // sessions can wait without holding a thread each. Send completes once no more than
+    // send_watermark frames are waiting to be written, 0 waits until the frame itself is written.
+    // Once inbox_limit messages wait for Receive, reads are paused until half of them are taken,
+    // inbox_limit <= 0 leaves the inbox unbounded.
+    class WebSocketAsyncClient : public WebSocketClientListener {
+    public:
+        WebSocketAsyncClient(int send_watermark = 64, int inbox_limit = 1024);
+        WebSocketAsyncClient(const WebSocketAsyncClient&) = delete;
+        WebSocketAsyncClient& operator=(const WebSocketAsyncClient&) = delete;
+        ~WebSocketAsyncClient();
+
+        // completes with 0 when the handshake is done, -1 when the connection failed
+        AsyncResult<int> Connect(std::string addr, int port, std::string path = "/");
+        void Disconnect();
+
+        // messages arrived before the call are returned in order, AsyncClosed after the close
+        AsyncResult<AsyncMessage> Receive();
+        AsyncResult<int> Send(std::string msg);
+        AsyncResult<int> SendBinary(const uint8_t* data, int len);
+
+        virtual void OnBinary(uint8_t* data, int len) override;
+        virtual void OnText(std::string& msg) override;
+        virtual void OnClosed() override;
+        virtual void OnConnected() override;
+
+    private:
+        WebSocketClient* client_;
+        int send_watermark_;
+        int inbox_limit_;
+
+        std::mutex mux_;
+        bool connected_ = false;
+        bool closed_ = false;
+        AsyncResult<int> connect_result_;
+        std::deque<AsyncMessage> inbox_;
+        bool receive_paused_ = false;
+        std::deque<AsyncResult<AsyncMessage>> receivers_;
+        std::deque<AsyncResult<int>> senders_;
+
+        AsyncResult<int> SendFrame(int type, const uint8_t* data, int len);
+        void Deliver(AsyncMessage& msg);
+        void OnWritten(int pending);
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,192 @@
+#include "WebSocketAsyncServer.h"
+
+#include "logger.h"
+
+namespace poca_ws {
+    WebSocketAsyncServer::WebSocketAsyncServer(int send_watermark, int inbox_limit)
+        : send_watermark_(send_watermark), inbox_limit_(inbox_limit) {
+        server_ = new WebSocketServer(*this);
+        server_->SetWriteCallback([this](int64_t user_id, int pending) { OnWritten(user_id, pending); });
+    }
+
+    WebSocketAsyncServer::~WebSocketAsyncServer() { delete server_; }
+
+    int WebSocketAsyncServer::ListenAndServe(int port) { return server_->ListenAndServe(port); }
+
+    void WebSocketAsyncServer::Close() {
+        server_->Close();
+        std::deque<AsyncResult<int64_t>> acceptors;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            closed_ = true;
+            acceptors.swap(acceptors_);
+        }
+        for (auto& acceptor : acceptors) {
+            acceptor.Set(-1);
+        }
+    }
+
+    WebSocketServer* WebSocketAsyncServer::GetServer() { return server_; }
+
+    AsyncResult<int64_t> WebSocketAsyncServer::Accept() {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (!accepted_.empty()) {
+            int64_t user_id = accepted_.front();
+            accepted_.pop_front();
+            return AsyncResult<int64_t>::Ready(user_id);
+        }
+        if (closed_) {
+            return AsyncResult<int64_t>::Ready(-1);
+        }
+        AsyncResult<int64_t> result;
+        acceptors_.push_back(result);
+        return result;
+    }
+
+    AsyncResult<AsyncMessage> WebSocketAsyncServer::Receive(int64_t user_id) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = sessions_.find(user_id);
+        if (it == sessions_.end()) {
+            return AsyncResult<AsyncMessage>::Ready(AsyncMessage());
+        }
+        Session& session = it->second;
+        if (!session.inbox.empty()) {
+            AsyncMessage msg = std::move(session.inbox.front());
+            session.inbox.pop_front();
+            if (session.receive_paused && (int)session.inbox.size() <= inbox_limit_ / 2) {
+                session.receive_paused = false;
+                server_->PauseReceive(user_id, false);
+            }
+            return AsyncResult<AsyncMessage>::Ready(std::move(msg));
+        }
+        if (session.closed) {
+            // the close has been seen by the reader, forget the session
+            sessions_.erase(it);
+            return AsyncResult<AsyncMessage>::Ready(AsyncMessage());
+        }
+        AsyncResult<AsyncMessage> result;
+        session.receivers.push_back(result);
+        return result;
+    }
+
+    AsyncResult<int> WebSocketAsyncServer::Send(int64_t user_id, std::string msg) {
+        return SendFrame(user_id, AsyncText, (const uint8_t*)msg.data(), (int)msg.size());
+    }
+
+    AsyncResult<int> WebSocketAsyncServer::SendBinary(int64_t user_id, const uint8_t* data, int len) {
+        return SendFrame(user_id, AsyncBinary, data, len);
+    }
+
+    AsyncResult<int> WebSocketAsyncServer::SendFrame(int64_t user_id, int type, const uint8_t* data, int len) {
+        // locked as in WebSocketAsyncClient::SendFrame
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = sessions_.find(user_id);
+        if (it == sessions_.end() || it->second.closed) {
+            return AsyncResult<int>::Ready(-1);
+        }
+        int ret;
+        if (type == AsyncBinary) {
+            ret = server_->SendBinary(user_id, (uint8_t*)data, len);
+        } else {
+            std::string msg((const char*)data, len);
+            ret = server_->SendMessage(user_id, msg);
+        }
+        if (ret != 0 || server_->GetPendingSendNum(user_id) <= send_watermark_) {
+            return AsyncResult<int>::Ready(ret);
+        }
+        AsyncResult<int> result;
+        it->second.senders.push_back(result);
+        return result;
+    }
+
+    void WebSocketAsyncServer::OnWritten(int64_t user_id, int pending) {
+        if (pending > send_watermark_) return;
+        std::deque<AsyncResult<int>> senders;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            auto it = sessions_.find(user_id);
+            if (it == sessions_.end()) return;
+            senders.swap(it->second.senders);
+        }
+        for (auto& sender : senders) {
+            sender.Set(0);
+        }
+    }
+
+    void WebSocketAsyncServer::Deliver(int64_t user_id, AsyncMessage& msg) {
+        AsyncResult<AsyncMessage> receiver;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            auto it = sessions_.find(user_id);
+            if (it == sessions_.end()) return;
+            Session& session = it->second;
+            if (session.receivers.empty()) {
+                session.inbox.push_back(std::move(msg));
+                // bounded as in WebSocketAsyncClient::Deliver
+                if (inbox_limit_ > 0 && !session.receive_paused && (int)session.inbox.size() >= inbox_limit_) {
+                    session.receive_paused = true;
+                    server_->PauseReceive(user_id, true);
+                }
+                return;
+            }
+            receiver = session.receivers.front();
+            session.receivers.pop_front();
+        }
+        receiver.Set(std::move(msg));
+    }
+
+    void WebSocketAsyncServer::OnBinary(int64_t user_id, uint8_t* data, int len) {
+        AsyncMessage msg;
+        msg.type = AsyncBinary;
+        msg.data.assign((char*)data, len);
+        Deliver(user_id, msg);
+    }
+
+    void WebSocketAsyncServer::OnText(int64_t user_id, std::string& text) {
+        AsyncMessage msg;
+        msg.type = AsyncText;
+        msg.data = text;
+        Deliver(user_id, msg);
+    }
+
+    void WebSocketAsyncServer::OnConnect(int64_t user_id) {
+        AsyncResult<int64_t> acceptor;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            // a user_id is the connection pointer and may be reused, drop what an old reader left
+            sessions_[user_id] = Session();
+            if (acceptors_.empty()) {
+                accepted_.push_back(user_id);
+                return;
+            }
+            acceptor = acceptors_.front();
+            acceptors_.pop_front();
+        }
+        acceptor.Set(user_id);
+    }
+
+    void WebSocketAsyncServer::OnClose(int64_t user_id) {
+        std::deque<AsyncResult<AsyncMessage>> receivers;
+        std::deque<AsyncResult<int>> senders;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            auto it = sessions_.find(user_id);
+            if (it == sessions_.end()) return;
+            it->second.closed = true;
+            receivers.swap(it->second.receivers);
+            senders.swap(it->second.senders);
+            if (it->second.inbox.empty()) {
+                // nothing left to read, a later Receive sees the close from the missing session;
+                // otherwise Receive forgets the session once it has read the inbox
+                sessions_.erase(it);
+            }
+        }
+        for (auto& receiver : receivers) {
+            receiver.Set(AsyncMessage());
+        }
+        for (auto& sender : senders) {
+            sender.Set(-1);
+        }
+        poca_info("async session closed, user_id: %lld", (long long)user_id);
+    }
+}  // namespace poca_ws
@@ -0,0 +1,62 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_SERVER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_ASYNC_SERVER_H
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "WebSocketAsync.h"
+#include "WebSocketServer.h"
+#include "WebSocketServerListener.h"
+
+namespace poca_ws {
+    // Awaitable WebSocketServer, see WebSocketAsyncClient. Receive and Accept complete on the
+    // callback thread, Send on the service thread.
+    class WebSocketAsyncServer : public WebSocketServerListener {
+    public:
+        WebSocketAsyncServer(int send_watermark = 64, int inbox_limit = 1024);
+        WebSocketAsyncServer(const WebSocketAsyncServer&) = delete;
+        WebSocketAsyncServer& operator=(const WebSocketAsyncServer&) = delete;
+        ~WebSocketAsyncServer();
+
+        int ListenAndServe(int port);
+        void Close();
+        // for the Set* options, which must be applied before ListenAndServe
+        WebSocketServer* GetServer();
+
+        // completes with the user_id of the next connection, -1 once the server is closed
+        AsyncResult<int64_t> Accept();
+        AsyncResult<AsyncMessage> Receive(int64_t user_id);
+        AsyncResult<int> Send(int64_t user_id, std::string msg);
+        AsyncResult<int> SendBinary(int64_t user_id, const uint8_t* data, int len);
+
+        virtual void OnBinary(int64_t user_id, uint8_t* data, int len) override;
+        virtual void OnText(int64_t user_id, std::string& msg) override;
+        virtual void OnConnect(int64_t user_id) override;
+        virtual void OnClose(int64_t user_id) override;
+
+    private:
+        WebSocketServer* server_;
+        int send_watermark_;
+        int inbox_limit_;
+
+        struct Session {
+            bool closed = false;
+            std::deque<AsyncMessage> inbox;
+            bool receive_paused = false;
+            std::deque<AsyncResult<AsyncMessage>> receivers;
+            std::deque<AsyncResult<int>> senders;
+        };
+        std::mutex mux_;
+        bool closed_ = false;
+        std::deque<int64_t> accepted_;
+        std::deque<AsyncResult<int64_t>> acceptors_;
+        std::map<int64_t, Session> sessions_;
+
+        AsyncResult<int> SendFrame(int64_t user_id, int type, const uint8_t* data, int len);
+        void Deliver(int64_t user_id, AsyncMessage& msg);
+        void OnWritten(int64_t user_id, int pending);
+    };
+}  // namespace poca_ws
+#endif
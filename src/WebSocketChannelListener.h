@@ -0,0 +1,18 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_CHANNEL_LISTENER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_CHANNEL_LISTENER_H
+
+#include <cstdint>
+#include <string>
+
+namespace poca_ws {
+    class WebSocketChannelListener {
+    public:
+        WebSocketChannelListener() {}
+        ~WebSocketChannelListener() {}
+
+        virtual void OnBinary(uint32_t channel, uint8_t* data, int len) = 0;
+        virtual void OnText(uint32_t channel, std::string& msg) = 0;
+        virtual void OnClosed(uint32_t channel) = 0;
+    };
+}  // namespace poca_ws
+#endif
@@ -1,10 +1,13 @@
 #include "WebSocketClient.h"
 
 #include <libwebsockets.h>
+#include <unistd.h>
 
 #include "logger.h"
 
 #define MAX_PAYLOAD_SIZE 8192
+// a paused ring reader checks this often whether it may go on
+#define SHM_PAUSE_SLICE_US 10000
 
 namespace poca_ws {
     std::once_flag WebSocketClient::once_flag_;
@@ -16,6 +19,12 @@ namespace poca_ws {
     lws_context *WebSocketClient::context_;
     std::map<lws *, WebSocketClient *> WebSocketClient::map_lws_wsc_;
     SyncDeque<std::function<void(void)>> WebSocketClient::conn_queue_;
+    bool WebSocketClient::external_loop_ = false;
+    WebSocketPoller WebSocketClient::poller_;
+    SyncDeque<WebSocketFrameBuffer *> WebSocketClient::shm_receive_;
+    SyncDeque<WebSocketFrameBuffer *> WebSocketClient::shm_receive_empty_;
+    std::atomic_bool WebSocketClient::shm_wake_(false);
+    std::set<WebSocketClient *> WebSocketClient::receive_pause_changed_;
 
     void WebSocketClient::EventLoop() {
         std::function<void(void)> conn_request;
@@ -30,11 +39,39 @@ namespace poca_ws {
     }
 
     void WebSocketClient::CloseAll() {
+        if (external_loop_) {
+            if (context_ != nullptr) {
+                lws_context_destroy(context_);
+                context_ = nullptr;
+            }
+            return;
+        }
         running_.store(false);
         lws_cancel_service(context_);
         worker_thread_.join();
     }
 
+    int WebSocketClient::AttachExternalLoop() {
+        if (!WebSocketPoller::Supported()) {
+            poca_info("libwebsockets was built without LWS_WITH_EXTERNAL_POLL, no external loop");
+            return -1;
+        }
+        external_loop_ = true;
+        return 0;
+    }
+
+    int WebSocketClient::GetPollFd() { return poller_.GetFd(); }
+
+    int WebSocketClient::Poll() {
+        if (context_ == nullptr) return -1;
+        return poller_.Poll(context_);
+    }
+
+    int WebSocketClient::GetNextTimeoutMs() {
+        if (context_ == nullptr) return -1;
+        return poller_.GetTimeoutMs(context_);
+    }
+
     WebSocketClient::WebSocketClient(WebSocketClientListener &listener) {
         std::call_once(once_flag_, [&]() {
             static lws_protocols protocols[] = {{
@@ -48,17 +85,29 @@ namespace poca_ws {
             ctx_info.port = CONTEXT_PORT_NO_LISTEN;
             ctx_info.protocols = protocols;
             ctx_info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+            if (external_loop_) {
+                poller_.Init();
+                context_ = lws_create_context(&ctx_info);
+                return;
+            }
             context_ = lws_create_context(&ctx_info);
             running_.store(true);
             worker_thread_ = std::thread(&WebSocketClient::EventLoop);
         });
-        std::unique_lock<std::mutex> lck(mux_);
-        cv_.wait(lck, [&]() { return protocol_inited_ == true; });
+        if (!external_loop_) {
+            std::unique_lock<std::mutex> lck(mux_);
+            cv_.wait(lck, [&]() { return protocol_inited_ == true; });
+        }
         listener_ = &listener;
         receive_buf_internal_ = new WebSocketFrameBuffer();
     }
 
     WebSocketClient::~WebSocketClient() {
+        shm_.reset();
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            receive_pause_changed_.erase(this);
+        }
         delete receive_buf_internal_;
         WebSocketFrameBuffer *send_buf;
         while (deque_send_buf_empty_.GetNoWait(send_buf)) {
@@ -71,8 +120,13 @@ namespace poca_ws {
 
     int WebSocketClient::LwsClientCallback(lws *wsi, lws_callback_reasons reason, void *user, void *in, size_t len) {
         // poca_info("LwsClientCallback, wsi: %p, reason: %d", wsi, reason);
+        if (external_loop_ && poller_.HandlePollCallback(reason, in)) {
+            return 0;
+        }
         std::unique_lock<std::mutex> lck(mux_);
-        std::function<void(void)> msg_submit;
+        // listener and write callbacks run after mux_ is released, so they may send, connect or
+        // complete continuations that touch other clients
+        std::vector<std::function<void(void)>> deferred;
         int first = 0, final = 0;
         switch (reason) {
             case LWS_CALLBACK_PROTOCOL_INIT:
@@ -85,86 +139,297 @@ namespace poca_ws {
                     map_lws_wsc_[wsi]->receive_buf_internal_->Clear();
                 }
                 map_lws_wsc_[wsi]->receive_buf_internal_->Push((uint8_t *)in, len);
-                if (final) {
-                    int is_binary = lws_frame_is_binary(wsi);
-                    if (is_binary) {
-                        map_lws_wsc_[wsi]->listener_->OnBinary(map_lws_wsc_[wsi]->receive_buf_internal_->GetPtr(),
-                                                               map_lws_wsc_[wsi]->receive_buf_internal_->GetLength());
-                    } else {
-                        std::string msg((char *)map_lws_wsc_[wsi]->receive_buf_internal_->GetPtr());
-                        map_lws_wsc_[wsi]->listener_->OnText(msg);
-                    }
+                if (final && map_lws_wsc_[wsi]->HandleLocalTransport()) {
                     map_lws_wsc_[wsi]->receive_buf_internal_->Clear();
+                } else if (final) {
+                    WebSocketClient *client = map_lws_wsc_[wsi];
+                    int is_binary = lws_frame_is_binary(wsi);
+                    deferred.push_back([client, is_binary]() {
+                        if (is_binary) {
+                            client->listener_->OnBinary(client->receive_buf_internal_->GetPtr(),
+                                                        client->receive_buf_internal_->GetLength());
+                        } else {
+                            std::string msg((char *)client->receive_buf_internal_->GetPtr());
+                            client->listener_->OnText(msg);
+                        }
+                        client->receive_buf_internal_->Clear();
+                    });
                 }
                 break;
-            case LWS_CALLBACK_CLIENT_WRITEABLE:
+            case LWS_CALLBACK_CLIENT_WRITEABLE: {
                 if (map_lws_wsc_[wsi]->close_.load() == true) {
                     return -1;
                 }
                 WebSocketFrameBuffer *msg_submit;
-                if (map_lws_wsc_[wsi]->deque_send_buf_full_.GetNoWait(msg_submit)) {
-                    lws_write(wsi, msg_submit->GetPtr() + LWS_PRE, msg_submit->GetLength(),
+                int shm_ret = 0;
+                if (map_lws_wsc_[wsi]->shm_active_.load()) {
+                    shm_ret = map_lws_wsc_[wsi]->WriteShm(wsi);
+                } else if (map_lws_wsc_[wsi]->deque_send_buf_full_.GetNoWait(msg_submit)) {
+                    lws_write(wsi, msg_submit->GetPtr() + LWS_PRE, msg_submit->GetLength() - LWS_PRE,
                               (lws_write_protocol)msg_submit->GetType());
+                    if (msg_submit == map_lws_wsc_[wsi]->shm_ack_) {
+                        // the server reads the ring only after the ack, so what follows it goes there
+                        std::unique_lock<std::mutex> shm_lck(map_lws_wsc_[wsi]->shm_send_mux_);
+                        map_lws_wsc_[wsi]->shm_ack_ = nullptr;
+                        map_lws_wsc_[wsi]->shm_active_.store(true);
+                    }
                     msg_submit->Clear();
                     map_lws_wsc_[wsi]->deque_send_buf_empty_.Put(msg_submit);
                 }
-                break;
+                if (shm_ret != SHM_RING_FULL && map_lws_wsc_[wsi]->deque_send_buf_full_.GetSize() > 0) {
+                    lws_callback_on_writable(wsi);
+                }
+                if (map_lws_wsc_[wsi]->write_callback_) {
+                    WebSocketClient *client = map_lws_wsc_[wsi];
+                    int pending = client->deque_send_buf_full_.GetSize();
+                    deferred.push_back([client, pending]() { client->write_callback_(pending); });
+                }
+            } break;
             case LWS_CALLBACK_CLIENT_ESTABLISHED:
                 poca_info("%s: established connection, wsi = %p", __func__, wsi);
                 lws_callback_on_writable(wsi);
                 map_lws_wsc_[wsi]->conn_established_ = true;
+                {
+                    WebSocketClient *client = map_lws_wsc_[wsi];
+                    client->receive_open_ = true;
+                    if (client->receive_paused_.load()) {
+                        lws_rx_flow_control(wsi, 0);
+                    }
+                    deferred.push_back([client]() { client->listener_->OnConnected(); });
+                }
                 break;
+            case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: {
+                poca_info("%s: connection error: %s", __func__, in ? (char *)in : "");
+                auto it = map_lws_wsc_.find(wsi);
+                if (it != map_lws_wsc_.end()) {
+                    WebSocketClient *client = it->second;
+                    deferred.push_back([client]() { client->listener_->OnClosed(); });
+                }
+            } break;
             case LWS_CALLBACK_CLIENT_CLOSED:
-                map_lws_wsc_[wsi]->listener_->OnClosed();
+                map_lws_wsc_[wsi]->receive_open_ = false;
+                if (map_lws_wsc_[wsi]->shm_) {
+                    map_lws_wsc_[wsi]->shm_active_.store(false);
+                    // see LWS_CALLBACK_CLOSED in WebSocketServer
+                    map_lws_wsc_[wsi]->shm_->Stop();
+                    DeliverShmReceive(deferred);
+                }
+                {
+                    WebSocketClient *client = map_lws_wsc_[wsi];
+                    deferred.push_back([client]() { client->listener_->OnClosed(); });
+                }
+                break;
+            case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+                DeliverShmReceive(deferred);
+                ApplyReceivePause();
                 break;
+            case LWS_CALLBACK_TIMER:
+                // retry of a full ring
+                lws_callback_on_writable(wsi);
+                break;
+            case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER: {
+                auto it = map_lws_wsc_.find(wsi);
+                if (it != map_lws_wsc_.end() && it->second->shm_requested_) {
+                    unsigned char **p = (unsigned char **)in;
+                    if (lws_add_http_header_by_name(wsi, (const unsigned char *)SHM_REQUEST_HEADER,
+                                                    (const unsigned char *)"1", 1, p, (*p) + len)) {
+                        return -1;
+                    }
+                }
+            } break;
             default:
                 break;
         }
-        return lws_callback_http_dummy(wsi, reason, user, in, len);
+        int ret = lws_callback_http_dummy(wsi, reason, user, in, len);
+        lck.unlock();
+        for (auto &fn : deferred) {
+            fn();
+        }
+        return ret;
     }
 
     void WebSocketClient::WaitConnEstablish() {
+        // frames queued before the handshake are flushed on LWS_CALLBACK_CLIENT_ESTABLISHED
+        if (external_loop_) return;
+        // sending from a listener callback runs on the worker thread, which must not wait for itself
+        if (conn_established_.load()) return;
         std::unique_lock<std::mutex> lck(mux_);
         cv_.wait(lck, [&]() { return conn_established_ == true; });
     }
 
-    int WebSocketClient::SendMessage(std::string &msg) {
-        WaitConnEstablish();
+    WebSocketFrameBuffer *WebSocketClient::QueueFrame(uint8_t *data, int len, int type) {
         WebSocketFrameBuffer *msg_frame;
         if (!deque_send_buf_empty_.GetNoWait(msg_frame)) {
             msg_frame = new WebSocketFrameBuffer();
         }
         msg_frame->Push(nullptr, LWS_PRE);
-        msg_frame->Push((uint8_t *)msg.c_str(), (int)msg.size());
-        msg_frame->SetType(LWS_WRITE_TEXT);
+        msg_frame->Push(data, len);
+        msg_frame->SetType(type);
 
         deque_send_buf_full_.Put(msg_frame);
         lws_callback_on_writable(wsi_);
         lws_cancel_service(context_);
+        return msg_frame;
+    }
 
+    int WebSocketClient::SendFrame(uint8_t *data, int len, int type) {
+        WaitConnEstablish();
+        if (!shm_active_.load()) {
+            QueueFrame(data, len, type);
+            return 0;
+        }
+        std::unique_lock<std::mutex> lck(shm_send_mux_);
+        if (deque_send_buf_full_.GetSize() > 0) {
+            // keep behind the backlog waiting for room in the ring
+            QueueFrame(data, len, type);
+            return 0;
+        }
+        int offset = 0;
+        int ret = shm_->Write(type, data, len, offset);
+        if (ret != SHM_RING_FULL) {
+            return ret;
+        }
+        shm_offset_ = offset;
+        QueueFrame(data, len, type);
         return 0;
     }
 
-    int WebSocketClient::SendBinary(uint8_t *data, int len) {
-        WaitConnEstablish();
-        WebSocketFrameBuffer *msg_frame;
-        if (!deque_send_buf_empty_.GetNoWait(msg_frame)) {
-            msg_frame = new WebSocketFrameBuffer();
+    int WebSocketClient::WriteShm(lws *wsi) {
+        std::unique_lock<std::mutex> lck(shm_send_mux_);
+        WebSocketFrameBuffer *frame;
+        while (deque_send_buf_full_.PeekNoWait(frame)) {
+            int ret = shm_->Write(frame->GetType(), frame->GetPtr() + LWS_PRE, frame->GetLength() - LWS_PRE,
+                                  shm_offset_);
+            if (ret == SHM_RING_FULL) {
+                lws_set_timer_usecs(wsi, SHM_RETRY_US);
+                if (external_loop_) {
+                    poller_.AddTimer(SHM_RETRY_US);
+                }
+                return SHM_RING_FULL;
+            }
+            deque_send_buf_full_.GetNoWait(frame);
+            shm_offset_ = 0;
+            frame->Clear();
+            deque_send_buf_empty_.Put(frame);
         }
-        msg_frame->Push(nullptr, LWS_PRE);
-        msg_frame->Push(data, len);
-        msg_frame->SetType(LWS_WRITE_BINARY);
+        return 0;
+    }
 
-        deque_send_buf_full_.Put(msg_frame);
-        lws_callback_on_writable(wsi_);
+    void WebSocketClient::PauseReceive(bool paused) {
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            if (receive_paused_.exchange(paused) == paused) return;
+            receive_pause_changed_.insert(this);
+        }
         lws_cancel_service(context_);
-        return 0;
+    }
+
+    void WebSocketClient::ApplyReceivePause() {
+        for (auto client : receive_pause_changed_) {
+            if (client->receive_open_) {
+                lws_rx_flow_control(client->wsi_, client->receive_paused_.load() ? 0 : 1);
+            }
+        }
+        receive_pause_changed_.clear();
+    }
+
+    void WebSocketClient::DeliverShmReceive(std::vector<std::function<void(void)>> &deferred) {
+        shm_wake_.store(false);
+        WebSocketFrameBuffer *on_receive;
+        while (shm_receive_.GetNoWait(on_receive)) {
+            auto it = map_lws_wsc_.find((lws *)on_receive->GetUserId());
+            if (it == map_lws_wsc_.end()) {
+                on_receive->Clear();
+                shm_receive_empty_.Put(on_receive);
+                continue;
+            }
+            WebSocketClient *client = it->second;
+            deferred.push_back([client, on_receive]() mutable {
+                if (!client->close_.load()) {
+                    if (on_receive->GetType() == LWS_WRITE_BINARY) {
+                        client->listener_->OnBinary(on_receive->GetPtr(), on_receive->GetLength());
+                    } else {
+                        std::string text((char *)on_receive->GetPtr(), on_receive->GetLength());
+                        client->listener_->OnText(text);
+                    }
+                }
+                on_receive->Clear();
+                shm_receive_empty_.Put(on_receive);
+            });
+        }
+    }
+
+    int WebSocketClient::SendMessage(std::string &msg) {
+        return SendFrame((uint8_t *)msg.c_str(), (int)msg.size(), LWS_WRITE_TEXT);
+    }
+
+    int WebSocketClient::SendBinary(uint8_t *data, int len) { return SendFrame(data, len, LWS_WRITE_BINARY); }
+
+    void WebSocketClient::SetLocalTransport(bool enable) { local_transport_ = enable; }
+
+    int WebSocketClient::GetPendingSendNum() { return deque_send_buf_full_.GetSize(); }
+
+    void WebSocketClient::SetWriteCallback(std::function<void(int pending)> callback) {
+        write_callback_ = callback;
+    }
+
+    static bool IsLoopbackAddress(const std::string &addr) {
+        return addr == "localhost" || addr == "::1" || addr.compare(0, 4, "127.") == 0;
+    }
+
+    bool WebSocketClient::HandleLocalTransport() {
+        if (!shm_requested_) return false;
+        std::string msg((char *)receive_buf_internal_->GetPtr(), receive_buf_internal_->GetLength());
+        if (!shm_ && msg.compare(0, strlen(SHM_OFFER_MAGIC), SHM_OFFER_MAGIC) == 0) {
+            std::shared_ptr<WebSocketShmChannel> shm = std::make_shared<WebSocketShmChannel>();
+            if (shm->Attach(msg.substr(strlen(SHM_OFFER_MAGIC))) != 0) {
+                shm_requested_ = false;
+                QueueFrame((uint8_t *)SHM_NACK_MAGIC, strlen(SHM_NACK_MAGIC), LWS_WRITE_TEXT);
+                return true;
+            }
+            shm_ = shm;
+            shm_ack_ = QueueFrame((uint8_t *)SHM_ACK_MAGIC, strlen(SHM_ACK_MAGIC), LWS_WRITE_TEXT);
+            return true;
+        }
+        if (shm_ && !shm_reading_ && msg == SHM_SWITCH_MAGIC) {
+            shm_reading_ = true;
+            lws *wsi = wsi_;
+            // the client outlives the reader, shm_ is stopped before the client is destroyed
+            WebSocketClient *client = this;
+            WebSocketShmChannel *channel = shm_.get();
+            shm_->Start([wsi, client, channel](int type, uint8_t *data, int len) {
+                WebSocketFrameBuffer *on_receive;
+                if (!shm_receive_empty_.GetNoWait(on_receive)) {
+                    on_receive = new WebSocketFrameBuffer();
+                }
+                on_receive->Push(data, len);
+                on_receive->SetUserId(int64_t(wsi));
+                on_receive->SetType(type);
+                shm_receive_.Put(on_receive);
+                if (!shm_wake_.exchange(true)) {
+                    lws_cancel_service(context_);
+                }
+                // a paused reader leaves the rest in the ring, the server backs up on it
+                while (client->receive_paused_.load() && !channel->IsClosed()) {
+                    usleep(SHM_PAUSE_SLICE_US);
+                }
+            });
+            poca_info("switched to shared memory transport, wsi: %p", wsi_);
+            return true;
+        }
+        return false;
     }
 
     int WebSocketClient::Connect(std::string addr, int port, std::string path) {
         server_address_ = addr;
         port_ = port;
         path_ = path;
+        shm_.reset();
+        shm_active_.store(false);
+        shm_reading_ = false;
+        shm_ack_ = nullptr;
+        shm_offset_ = 0;
+        shm_requested_ = local_transport_ && IsLoopbackAddress(server_address_);
 
         lws_client_connect_info i;
 
@@ -198,6 +463,11 @@ namespace poca_ws {
         };
 
         close_.store(false);
+        // connecting from a listener callback or a continuation runs on the worker thread itself
+        if (external_loop_ || std::this_thread::get_id() == worker_thread_.get_id()) {
+            client_conn();
+            return ret;
+        }
         conn_queue_.Put(client_conn);
         conn_cv.wait(conn_lck, [&]() { return ret != -1; });
         return ret;
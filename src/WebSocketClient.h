@@ -4,12 +4,17 @@
 #include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "WebSocketClientListener.h"
 #include "WebSocketFrameBuffer.h"
+#include "WebSocketPoller.h"
+#include "WebSocketShmChannel.h"
 #include "libwebsockets.h"
 #include "sync_deque.h"
 
@@ -26,9 +31,31 @@ namespace poca_ws {
         void Disconnect();
         static void CloseAll();
 
+        // Drive every client from an externally owned loop instead of the internal worker thread,
+        // must be called before the first WebSocketClient is created, -1 when lws was built without
+        // LWS_WITH_EXTERNAL_POLL. Watch GetPollFd() for readability and call Poll() from the loop
+        // thread, waiting at most GetNextTimeoutMs(); listener callbacks run inside Poll() and
+        // Connect/Send never block.
+        static int AttachExternalLoop();
+        static int GetPollFd();
+        static int Poll();
+        static int GetNextTimeoutMs();
+
         int SendMessage(std::string& msg);
         int SendBinary(uint8_t* data, int len);
 
+        // on by default: when connecting to a loopback address, ask the server for the shared
+        // memory transport. Only servers with SetLocalTransport(true) answer, others are unaffected
+        void SetLocalTransport(bool enable);
+
+        // stop or restart reading from the server, applied on the service thread
+        void PauseReceive(bool paused);
+
+        // frames queued on the websocket and not yet written
+        int GetPendingSendNum();
+        // called on the service thread after each frame is written, must not block
+        void SetWriteCallback(std::function<void(int pending)> callback);
+
     private:
         WebSocketClientListener* listener_;
 
@@ -37,13 +64,32 @@ namespace poca_ws {
         std::string server_address_;
         int port_;
         std::string path_;
-        bool conn_established_ = false;
+        std::atomic_bool conn_established_ = ATOMIC_VAR_INIT(false);
         std::atomic_bool close_ = ATOMIC_VAR_INIT(false);
         WebSocketFrameBuffer* receive_buf_internal_;
 
         SyncDeque<WebSocketFrameBuffer*> deque_send_buf_empty_;
         SyncDeque<WebSocketFrameBuffer*> deque_send_buf_full_;
         void WaitConnEstablish();
+        WebSocketFrameBuffer* QueueFrame(uint8_t* data, int len, int type);
+        int SendFrame(uint8_t* data, int len, int type);
+        std::function<void(int pending)> write_callback_;
+
+        bool local_transport_ = true;
+        bool shm_requested_ = false;
+        bool shm_reading_ = false;
+        // sends move to the ring once the ack frame has been written
+        WebSocketFrameBuffer* shm_ack_ = nullptr;
+        std::atomic_bool shm_active_ = ATOMIC_VAR_INIT(false);
+        std::shared_ptr<WebSocketShmChannel> shm_;
+        std::mutex shm_send_mux_;
+        int shm_offset_ = 0;  // already written part of the front frame
+        bool HandleLocalTransport();
+        int WriteShm(lws* wsi);
+
+        std::atomic_bool receive_paused_ = ATOMIC_VAR_INIT(false);
+        // mux_ held: the wsi is open and reads can be paused
+        bool receive_open_ = false;
 
         static int LwsClientCallback(lws* wsi, lws_callback_reasons reason, void* user, void* in, size_t len);
         static void EventLoop();
@@ -57,6 +103,17 @@ namespace poca_ws {
         static lws_context* context_;
         static std::map<lws*, WebSocketClient*> map_lws_wsc_;
         static SyncDeque<std::function<void(void)>> conn_queue_;
+        static bool external_loop_;
+        static WebSocketPoller poller_;
+        // filled by the ring readers, delivered on the service thread; user id is the wsi.
+        // Readers only wake the service thread when shm_wake_ is clear, one wake per burst
+        static SyncDeque<WebSocketFrameBuffer*> shm_receive_;
+        static SyncDeque<WebSocketFrameBuffer*> shm_receive_empty_;
+        static std::atomic_bool shm_wake_;
+        // clients whose receive_paused_ changed, under mux_
+        static std::set<WebSocketClient*> receive_pause_changed_;
+        static void ApplyReceivePause();
+        static void DeliverShmReceive(std::vector<std::function<void(void)>>& deferred);
     };
 }  // namespace poca_ws
 #endif
\ No newline at end of file
@@ -12,6 +12,7 @@ namespace poca_ws {
         virtual void OnBinary(uint8_t* data, int len) = 0;
         virtual void OnText(std::string& msg) = 0;
         virtual void OnClosed() = 0;
+        virtual void OnConnected() {}
     };
 }  // namespace poca_ws
 #endif
@@ -9,6 +9,7 @@ namespace poca_ws {
         buf_ = new uint8_t[capacity_];
         memset(buf_, 0, capacity_);
         len_ = 0;
+        memset(trace_stamps_, 0, sizeof(trace_stamps_));
     }
 
     WebSocketFrameBuffer::~WebSocketFrameBuffer() { delete[] buf_; }
@@ -25,6 +26,18 @@ namespace poca_ws {
 
     int64_t WebSocketFrameBuffer::GetUserId() { return user_id_; }
 
+    void WebSocketFrameBuffer::SetKey(const std::string& key) { key_ = key; }
+
+    const std::string& WebSocketFrameBuffer::GetKey() { return key_; }
+
+    void WebSocketFrameBuffer::SetTraced(bool traced) { traced_ = traced; }
+
+    bool WebSocketFrameBuffer::IsTraced() { return traced_; }
+
+    void WebSocketFrameBuffer::SetTraceStamp(int stage, int64_t ns) { trace_stamps_[stage] = ns; }
+
+    int64_t WebSocketFrameBuffer::GetTraceStamp(int stage) { return trace_stamps_[stage]; }
+
     void WebSocketFrameBuffer::Push(uint8_t* data, int size) {
         bool should_move = false;
         while (len_ + size >= capacity_) {
@@ -47,6 +60,11 @@ namespace poca_ws {
     void WebSocketFrameBuffer::Clear() {
         memset(buf_, 0, capacity_);
         len_ = 0;
+        key_.clear();
+        if (traced_) {
+            traced_ = false;
+            memset(trace_stamps_, 0, sizeof(trace_stamps_));
+        }
     }
 
     uint8_t* WebSocketFrameBuffer::GetPtr() { return buf_; }
@@ -3,8 +3,20 @@
 
 #include <cstdint>
 #include <mutex>
+#include <string>
 
 namespace poca_ws {
+    enum {
+        TraceReceive = 0,
+        TraceEnqueue,
+        TraceDequeue,
+        TraceCallbackStart,
+        TraceCallbackEnd,
+        TraceSendEnqueue,
+        TraceWrite,
+        TraceStageNum
+    };
+
     class WebSocketFrameBuffer {
     public:
         WebSocketFrameBuffer();
@@ -21,6 +33,14 @@ namespace poca_ws {
         void SetUserId(int64_t user_id);
         int64_t GetUserId();
 
+        void SetKey(const std::string& key);
+        const std::string& GetKey();
+
+        void SetTraced(bool traced);
+        bool IsTraced();
+        void SetTraceStamp(int stage, int64_t ns);
+        int64_t GetTraceStamp(int stage);
+
         void Lock();
         void Unlock();
 
@@ -28,6 +48,9 @@ namespace poca_ws {
         std::mutex mux_;
         int type_;
         int64_t user_id_;
+        std::string key_;
+        bool traced_ = false;
+        int64_t trace_stamps_[TraceStageNum];
         int capacity_;
         int len_;
         uint8_t* buf_;
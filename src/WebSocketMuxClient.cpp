@@ -0,0 +1,137 @@
+#include "WebSocketMuxClient.h"
+
+#include "logger.h"
+
+namespace poca_ws {
+    WebSocketMuxClient::WebSocketMuxClient(int window)
+        : session_([this](std::string& msg) { Write(msg); }, window) {
+        client_ = new WebSocketClient(*this);
+    }
+
+    WebSocketMuxClient::~WebSocketMuxClient() { delete client_; }
+
+    int WebSocketMuxClient::Connect(std::string addr, int port, std::string path) {
+        return client_->Connect(addr, port, path);
+    }
+
+    void WebSocketMuxClient::Disconnect() { client_->Disconnect(); }
+
+    void WebSocketMuxClient::Write(std::string& msg) {
+        std::unique_lock<std::mutex> lck(write_mux_);
+        if (!connected_) {
+            unsent_.push_back(msg);
+            return;
+        }
+        client_->SendBinary((uint8_t*)msg.data(), (int)msg.size());
+    }
+
+    WebSocketChannelListener* WebSocketMuxClient::FindListener(uint32_t channel) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = listeners_.find(channel);
+        return it == listeners_.end() ? nullptr : it->second;
+    }
+
+    int WebSocketMuxClient::OpenChannel(uint32_t channel, WebSocketChannelListener& listener) {
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            if (listeners_.count(channel)) return -1;
+            listeners_[channel] = &listener;
+        }
+        if (session_.Open(channel) != 0) {
+            std::unique_lock<std::mutex> lck(mux_);
+            listeners_.erase(channel);
+            return -1;
+        }
+        return 0;
+    }
+
+    int WebSocketMuxClient::CloseChannel(uint32_t channel) {
+        if (session_.Close(channel) != 0) return -1;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            listeners_.erase(channel);
+        }
+        return 0;
+    }
+
+    void WebSocketMuxClient::SetAcceptListener(WebSocketChannelListener& listener) {
+        std::unique_lock<std::mutex> lck(mux_);
+        accept_listener_ = &listener;
+    }
+
+    int WebSocketMuxClient::SendMessage(uint32_t channel, std::string& msg) {
+        return session_.Send(channel, MuxText, (uint8_t*)msg.c_str(), (int)msg.size());
+    }
+
+    int WebSocketMuxClient::SendBinary(uint32_t channel, uint8_t* data, int len) {
+        return session_.Send(channel, MuxBinary, data, len);
+    }
+
+    void WebSocketMuxClient::OnBinary(uint8_t* data, int len) {
+        MuxFrame frame;
+        if (session_.Receive(data, len, frame) != 0) {
+            poca_info("drop invalid mux message, len: %d", len);
+            return;
+        }
+        WebSocketChannelListener* listener = nullptr;
+        switch (frame.type) {
+            case MuxOpen: {
+                std::unique_lock<std::mutex> lck(mux_);
+                if (!listeners_.count(frame.channel)) {
+                    listeners_[frame.channel] = accept_listener_;
+                }
+            } break;
+            case MuxClose:
+                listener = FindListener(frame.channel);
+                {
+                    std::unique_lock<std::mutex> lck(mux_);
+                    listeners_.erase(frame.channel);
+                }
+                if (listener) listener->OnClosed(frame.channel);
+                break;
+            case MuxText:
+                listener = FindListener(frame.channel);
+                if (listener) {
+                    std::string msg((char*)frame.payload, frame.len);
+                    listener->OnText(frame.channel, msg);
+                }
+                session_.Consumed(frame.channel, frame.len);
+                break;
+            case MuxBinary:
+                listener = FindListener(frame.channel);
+                if (listener) listener->OnBinary(frame.channel, frame.payload, frame.len);
+                session_.Consumed(frame.channel, frame.len);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void WebSocketMuxClient::OnText(std::string& msg) { poca_info("drop text message outside of a mux channel"); }
+
+    void WebSocketMuxClient::OnConnected() {
+        std::unique_lock<std::mutex> lck(write_mux_);
+        for (auto& msg : unsent_) {
+            client_->SendBinary((uint8_t*)msg.data(), (int)msg.size());
+        }
+        unsent_.clear();
+        connected_ = true;
+    }
+
+    void WebSocketMuxClient::OnClosed() {
+        {
+            std::unique_lock<std::mutex> lck(write_mux_);
+            connected_ = false;
+            unsent_.clear();
+        }
+        std::map<uint32_t, WebSocketChannelListener*> listeners;
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            listeners.swap(listeners_);
+        }
+        session_.Reset();
+        for (auto& it : listeners) {
+            if (it.second) it.second->OnClosed(it.first);
+        }
+    }
+}  // namespace poca_ws
@@ -0,0 +1,57 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_CLIENT_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_CLIENT_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "WebSocketChannelListener.h"
+#include "WebSocketClient.h"
+#include "WebSocketClientListener.h"
+#include "WebSocketMuxSession.h"
+
+namespace poca_ws {
+    // Many logical channels over one WebSocketClient connection, see WebSocketMuxSession.
+    class WebSocketMuxClient : public WebSocketClientListener {
+    public:
+        WebSocketMuxClient(int window = MUX_DEFAULT_WINDOW);
+        WebSocketMuxClient(const WebSocketMuxClient&) = delete;
+        WebSocketMuxClient& operator=(const WebSocketMuxClient&) = delete;
+        ~WebSocketMuxClient();
+
+        int Connect(std::string addr, int port, std::string path = "/");
+        void Disconnect();
+
+        int OpenChannel(uint32_t channel, WebSocketChannelListener& listener);
+        int CloseChannel(uint32_t channel);
+        // receives channels opened by the server, which are dropped when it is not set
+        void SetAcceptListener(WebSocketChannelListener& listener);
+
+        int SendMessage(uint32_t channel, std::string& msg);
+        int SendBinary(uint32_t channel, uint8_t* data, int len);
+
+        virtual void OnBinary(uint8_t* data, int len) override;
+        virtual void OnText(std::string& msg) override;
+        virtual void OnClosed() override;
+        virtual void OnConnected() override;
+
+    private:
+        WebSocketClient* client_;
+        WebSocketMuxSession session_;
+
+        std::mutex mux_;
+        std::map<uint32_t, WebSocketChannelListener*> listeners_;
+        WebSocketChannelListener* accept_listener_ = nullptr;
+
+        WebSocketChannelListener* FindListener(uint32_t channel);
+
+        // the session writes with its lock held, so until the handshake is done its messages wait
+        // here instead of blocking in WebSocketClient::SendBinary
+        std::mutex write_mux_;
+        bool connected_ = false;
+        std::vector<std::string> unsent_;
+        void Write(std::string& msg);
+    };
+}  // namespace poca_ws
+#endif
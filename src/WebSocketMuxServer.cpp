@@ -0,0 +1,101 @@
+#include "WebSocketMuxServer.h"
+
+#include "logger.h"
+
+namespace poca_ws {
+    WebSocketMuxServer::WebSocketMuxServer(WebSocketMuxServerListener& listener, int window) {
+        listener_ = &listener;
+        window_ = window;
+        server_ = new WebSocketServer(*this);
+    }
+
+    WebSocketMuxServer::~WebSocketMuxServer() { delete server_; }
+
+    int WebSocketMuxServer::ListenAndServe(int port) { return server_->ListenAndServe(port); }
+
+    void WebSocketMuxServer::Close() { server_->Close(); }
+
+    std::shared_ptr<WebSocketMuxSession> WebSocketMuxServer::FindSession(int64_t user_id) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = sessions_.find(user_id);
+        if (it == sessions_.end()) return nullptr;
+        return it->second;
+    }
+
+    int WebSocketMuxServer::OpenChannel(int64_t user_id, uint32_t channel) {
+        auto session = FindSession(user_id);
+        if (!session) return -1;
+        return session->Open(channel);
+    }
+
+    int WebSocketMuxServer::CloseChannel(int64_t user_id, uint32_t channel) {
+        auto session = FindSession(user_id);
+        if (!session) return -1;
+        return session->Close(channel);
+    }
+
+    int WebSocketMuxServer::SendMessage(int64_t user_id, uint32_t channel, std::string& msg) {
+        auto session = FindSession(user_id);
+        if (!session) return -1;
+        return session->Send(channel, MuxText, (uint8_t*)msg.c_str(), (int)msg.size());
+    }
+
+    int WebSocketMuxServer::SendBinary(int64_t user_id, uint32_t channel, uint8_t* data, int len) {
+        auto session = FindSession(user_id);
+        if (!session) return -1;
+        return session->Send(channel, MuxBinary, data, len);
+    }
+
+    void WebSocketMuxServer::OnBinary(int64_t user_id, uint8_t* data, int len) {
+        auto session = FindSession(user_id);
+        if (!session) return;
+        MuxFrame frame;
+        if (session->Receive(data, len, frame) != 0) {
+            poca_info("drop invalid mux message, user_id: %ld, len: %d", user_id, len);
+            return;
+        }
+        switch (frame.type) {
+            case MuxOpen:
+                listener_->OnChannelOpen(user_id, frame.channel);
+                break;
+            case MuxClose:
+                listener_->OnChannelClose(user_id, frame.channel);
+                break;
+            case MuxText: {
+                std::string msg((char*)frame.payload, frame.len);
+                listener_->OnText(user_id, frame.channel, msg);
+                session->Consumed(frame.channel, frame.len);
+            } break;
+            case MuxBinary:
+                listener_->OnBinary(user_id, frame.channel, frame.payload, frame.len);
+                session->Consumed(frame.channel, frame.len);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void WebSocketMuxServer::OnText(int64_t user_id, std::string& msg) {
+        poca_info("drop text message outside of a mux channel, user_id: %ld", user_id);
+    }
+
+    void WebSocketMuxServer::OnConnect(int64_t user_id) {
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            WebSocketServer* server = server_;
+            auto writer = [server, user_id](std::string& msg) {
+                server->SendBinary(user_id, (uint8_t*)msg.data(), (int)msg.size());
+            };
+            sessions_[user_id] = std::make_shared<WebSocketMuxSession>(writer, window_);
+        }
+        listener_->OnConnect(user_id);
+    }
+
+    void WebSocketMuxServer::OnClose(int64_t user_id) {
+        {
+            std::unique_lock<std::mutex> lck(mux_);
+            sessions_.erase(user_id);
+        }
+        listener_->OnClose(user_id);
+    }
+}  // namespace poca_ws
@@ -0,0 +1,48 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SERVER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SERVER_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "WebSocketMuxServerListener.h"
+#include "WebSocketMuxSession.h"
+#include "WebSocketServer.h"
+#include "WebSocketServerListener.h"
+
+namespace poca_ws {
+    // Many logical channels per WebSocketServer connection, see WebSocketMuxSession.
+    class WebSocketMuxServer : public WebSocketServerListener {
+    public:
+        WebSocketMuxServer(WebSocketMuxServerListener& listener, int window = MUX_DEFAULT_WINDOW);
+        WebSocketMuxServer() = delete;
+        WebSocketMuxServer(const WebSocketMuxServer&) = delete;
+        WebSocketMuxServer& operator=(const WebSocketMuxServer&) = delete;
+        ~WebSocketMuxServer();
+
+        int ListenAndServe(int port);
+        void Close();
+
+        int OpenChannel(int64_t user_id, uint32_t channel);
+        int CloseChannel(int64_t user_id, uint32_t channel);
+        int SendMessage(int64_t user_id, uint32_t channel, std::string& msg);
+        int SendBinary(int64_t user_id, uint32_t channel, uint8_t* data, int len);
+
+        virtual void OnBinary(int64_t user_id, uint8_t* data, int len) override;
+        virtual void OnText(int64_t user_id, std::string& msg) override;
+        virtual void OnConnect(int64_t user_id) override;
+        virtual void OnClose(int64_t user_id) override;
+
+    private:
+        WebSocketMuxServerListener* listener_;
+        WebSocketServer* server_;
+        int window_;
+
+        std::mutex mux_;
+        std::map<int64_t, std::shared_ptr<WebSocketMuxSession>> sessions_;
+
+        std::shared_ptr<WebSocketMuxSession> FindSession(int64_t user_id);
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,21 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SERVER_LISTENER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SERVER_LISTENER_H
+
+#include <cstdint>
+#include <string>
+
+namespace poca_ws {
+    class WebSocketMuxServerListener {
+    public:
+        WebSocketMuxServerListener() {}
+        ~WebSocketMuxServerListener() {}
+
+        virtual void OnBinary(int64_t user_id, uint32_t channel, uint8_t* data, int len) = 0;
+        virtual void OnText(int64_t user_id, uint32_t channel, std::string& msg) = 0;
+        virtual void OnChannelOpen(int64_t user_id, uint32_t channel) = 0;
+        virtual void OnChannelClose(int64_t user_id, uint32_t channel) = 0;
+        virtual void OnConnect(int64_t user_id) = 0;
+        virtual void OnClose(int64_t user_id) = 0;
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,154 @@
+#include "WebSocketMuxSession.h"
+
+#include "logger.h"
+
+namespace poca_ws {
+    WebSocketMuxSession::WebSocketMuxSession(Writer writer, int window) : writer_(writer) {
+        window_ = window > 0 ? window : MUX_DEFAULT_WINDOW;
+    }
+
+    WebSocketMuxSession::~WebSocketMuxSession() {}
+
+    void WebSocketMuxSession::EncodeVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    int WebSocketMuxSession::DecodeVarint(uint8_t* data, int len, uint64_t& value) {
+        value = 0;
+        for (int i = 0; i < len && i < 10; ++i) {
+            value |= uint64_t(data[i] & 0x7f) << (7 * i);
+            if ((data[i] & 0x80) == 0) return i + 1;
+        }
+        return -1;
+    }
+
+    void WebSocketMuxSession::EncodeHeader(std::string& out, int type, uint32_t channel) {
+        out.push_back((char)type);
+        EncodeVarint(out, channel);
+    }
+
+    bool WebSocketMuxSession::IsOpen(uint32_t channel) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = channels_.find(channel);
+        return it != channels_.end() && !it->second.closing;
+    }
+
+    void WebSocketMuxSession::Reset() {
+        std::unique_lock<std::mutex> lck(mux_);
+        channels_.clear();
+    }
+
+    void WebSocketMuxSession::WriteClose(uint32_t channel) {
+        std::string msg;
+        EncodeHeader(msg, MuxClose, channel);
+        writer_(msg);
+    }
+
+    int WebSocketMuxSession::Open(uint32_t channel) {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (channels_.count(channel)) return -1;
+        channels_[channel].send_window = window_;
+        std::string msg;
+        EncodeHeader(msg, MuxOpen, channel);
+        writer_(msg);
+        return 0;
+    }
+
+    int WebSocketMuxSession::Close(uint32_t channel) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = channels_.find(channel);
+        if (it == channels_.end() || it->second.closing) return -1;
+        if (!it->second.pending.empty()) {
+            it->second.closing = true;
+            return 0;
+        }
+        channels_.erase(it);
+        WriteClose(channel);
+        return 0;
+    }
+
+    int WebSocketMuxSession::Send(uint32_t channel, int type, uint8_t* data, int len) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = channels_.find(channel);
+        if (it == channels_.end() || it->second.closing) return -1;
+        std::string msg;
+        msg.reserve(len + 6);
+        EncodeHeader(msg, type, channel);
+        msg.append((char*)data, len);
+        Channel& ch = it->second;
+        // a window with any credit left admits one more message, so messages larger than the window still flow
+        if (ch.pending.empty() && ch.send_window > 0) {
+            ch.send_window -= len;
+            writer_(msg);
+        } else {
+            ch.pending.emplace_back(len, std::move(msg));
+        }
+        return 0;
+    }
+
+    int WebSocketMuxSession::Receive(uint8_t* data, int len, MuxFrame& frame) {
+        if (len < 2) return -1;
+        uint64_t channel;
+        int n = DecodeVarint(data + 1, len - 1, channel);
+        if (n < 0) return -1;
+        frame.type = data[0];
+        frame.channel = (uint32_t)channel;
+        frame.payload = data + 1 + n;
+        frame.len = len - 1 - n;
+
+        std::unique_lock<std::mutex> lck(mux_);
+        switch (frame.type) {
+            case MuxOpen:
+                if (!channels_.count(frame.channel)) {
+                    channels_[frame.channel].send_window = window_;
+                }
+                break;
+            case MuxClose:
+                channels_.erase(frame.channel);
+                break;
+            case MuxText:
+            case MuxBinary:
+                if (!channels_.count(frame.channel)) return -1;
+                break;
+            case MuxWindow: {
+                auto it = channels_.find(frame.channel);
+                uint64_t credit;
+                if (it == channels_.end() || DecodeVarint(frame.payload, frame.len, credit) < 0) return -1;
+                Channel& ch = it->second;
+                ch.send_window += credit;
+                while (!ch.pending.empty() && ch.send_window > 0) {
+                    ch.send_window -= ch.pending.front().first;
+                    writer_(ch.pending.front().second);
+                    ch.pending.pop_front();
+                }
+                if (ch.closing && ch.pending.empty()) {
+                    channels_.erase(it);
+                    WriteClose(frame.channel);
+                }
+            } break;
+            default:
+                poca_info("unknown mux frame type %d", frame.type);
+                return -1;
+        }
+        return 0;
+    }
+
+    void WebSocketMuxSession::Consumed(uint32_t channel, int len) {
+        std::unique_lock<std::mutex> lck(mux_);
+        auto it = channels_.find(channel);
+        if (it == channels_.end()) return;
+        Channel& ch = it->second;
+        ch.recv_consumed += len;
+        if (ch.recv_consumed >= window_ / 2) {
+            std::string msg;
+            EncodeHeader(msg, MuxWindow, channel);
+            EncodeVarint(msg, ch.recv_consumed);
+            writer_(msg);
+            ch.recv_consumed = 0;
+        }
+    }
+}  // namespace poca_ws
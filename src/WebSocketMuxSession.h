@@ -0,0 +1,71 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SESSION_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_MUX_SESSION_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define MUX_DEFAULT_WINDOW (1 << 20)
+
+namespace poca_ws {
+    enum { MuxOpen = 1, MuxClose, MuxText, MuxBinary, MuxWindow };
+
+    struct MuxFrame {
+        int type;
+        uint32_t channel;
+        uint8_t* payload;
+        int len;
+    };
+
+    // Channel state of one multiplexed connection. Every mux message is one binary websocket
+    // message: [type:1][channel:varint][payload]. Data is sent against a per channel window
+    // that the peer replenishes with MuxWindow frames as its listener consumes data, frames over
+    // the window wait in the channel. Both ends must use the same window size.
+    // Encoded messages go to the writer while the session lock is held, so the wire order always
+    // matches the channel order; the writer must only queue the message.
+    class WebSocketMuxSession {
+    public:
+        typedef std::function<void(std::string& msg)> Writer;
+
+        WebSocketMuxSession(Writer writer, int window = MUX_DEFAULT_WINDOW);
+        WebSocketMuxSession(const WebSocketMuxSession&) = delete;
+        WebSocketMuxSession& operator=(const WebSocketMuxSession&) = delete;
+        ~WebSocketMuxSession();
+
+        int Open(uint32_t channel);
+        // frames still waiting for window go out first, MuxClose follows once they are written
+        int Close(uint32_t channel);
+        int Send(uint32_t channel, int type, uint8_t* data, int len);
+        // parse a received message, window frames are consumed here and may release pending data
+        int Receive(uint8_t* data, int len, MuxFrame& frame);
+        // report data handed to the listener so the peer's window can be replenished
+        void Consumed(uint32_t channel, int len);
+        // forget every channel without writing, for a connection that is gone
+        void Reset();
+
+        bool IsOpen(uint32_t channel);
+
+    private:
+        struct Channel {
+            int64_t send_window;
+            int64_t recv_consumed = 0;
+            bool closing = false;
+            std::deque<std::pair<int, std::string>> pending;
+        };
+
+        Writer writer_;
+        int window_;
+        std::mutex mux_;
+        std::map<uint32_t, Channel> channels_;
+
+        void WriteClose(uint32_t channel);
+
+        static void EncodeVarint(std::string& out, uint64_t value);
+        static int DecodeVarint(uint8_t* data, int len, uint64_t& value);
+        static void EncodeHeader(std::string& out, int type, uint32_t channel);
+    };
+}  // namespace poca_ws
+#endif
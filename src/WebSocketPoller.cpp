@@ -0,0 +1,114 @@
+#include "WebSocketPoller.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "logger.h"
+
+#define MAX_POLL_EVENTS 64
+
+namespace poca_ws {
+    static int64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    WebSocketPoller::WebSocketPoller() {}
+
+    WebSocketPoller::~WebSocketPoller() {
+        if (epoll_fd_ >= 0) close(epoll_fd_);
+    }
+
+    bool WebSocketPoller::Supported() {
+#ifdef LWS_WITH_EXTERNAL_POLL
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int WebSocketPoller::Init() {
+        if (!Supported()) {
+            poca_info("libwebsockets was built without LWS_WITH_EXTERNAL_POLL, no external loop");
+            return -1;
+        }
+        if (epoll_fd_ >= 0) return 0;
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            poca_info("epoll_create1 failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    int WebSocketPoller::GetFd() { return epoll_fd_; }
+
+    int WebSocketPoller::HandlePollCallback(lws_callback_reasons reason, void* in) {
+        lws_pollargs* args = (lws_pollargs*)in;
+        epoll_event ev = {0};
+        switch (reason) {
+            case LWS_CALLBACK_ADD_POLL_FD:
+                ev.events = args->events;
+                ev.data.fd = args->fd;
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, args->fd, &ev);
+                fd_events_[args->fd] = args->events;
+                return 1;
+            case LWS_CALLBACK_DEL_POLL_FD:
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, args->fd, &ev);
+                fd_events_.erase(args->fd);
+                return 1;
+            case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+                ev.events = args->events;
+                ev.data.fd = args->fd;
+                epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, args->fd, &ev);
+                fd_events_[args->fd] = args->events;
+                return 1;
+            default:
+                break;
+        }
+        return 0;
+    }
+
+    int WebSocketPoller::Poll(lws_context* context) {
+        epoll_event events[MAX_POLL_EVENTS];
+        int n = epoll_wait(epoll_fd_, events, MAX_POLL_EVENTS, 0);
+        for (int i = 0; i < n; ++i) {
+            lws_pollfd pfd;
+            pfd.fd = events[i].data.fd;
+            pfd.events = (short)fd_events_[pfd.fd];
+            pfd.revents = (short)events[i].events;
+            lws_service_fd(context, &pfd);
+        }
+        // timers and rx buffered inside lws
+        lws_service_fd(context, nullptr);
+        if (lws_service_adjust_timeout(context, 1, 0) == 0) {
+            lws_service_tsi(context, -1, 0);
+        }
+        int64_t now_us = NowUs();
+        while (!timers_us_.empty() && *timers_us_.begin() <= now_us) {
+            timers_us_.erase(timers_us_.begin());
+        }
+        return n < 0 ? -1 : n;
+    }
+
+    void WebSocketPoller::AddTimer(int64_t delay_us) { timers_us_.insert(NowUs() + delay_us); }
+
+    int WebSocketPoller::GetTimeoutMs(lws_context* context, int max_ms) {
+        if (lws_service_adjust_timeout(context, max_ms, 0) == 0) {
+            return 0;
+        }
+        if (timers_us_.empty()) {
+            return max_ms;
+        }
+        int64_t wait_us = *timers_us_.begin() - NowUs();
+        if (wait_us <= 0) {
+            return 0;
+        }
+        // round up, waking before the timer is due would only spin
+        int64_t wait_ms = (wait_us + 999) / 1000;
+        return wait_ms < max_ms ? (int)wait_ms : max_ms;
+    }
+}  // namespace poca_ws
@@ -0,0 +1,43 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_POLLER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_POLLER_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+
+#include "libwebsockets.h"
+
+namespace poca_ws {
+    // Mirrors the lws pollfds into an epoll fd so an externally owned loop can watch a single fd
+    // and drive lws with Poll() on its own thread. Requires libwebsockets built with
+    // LWS_WITH_EXTERNAL_POLL.
+    class WebSocketPoller {
+    public:
+        WebSocketPoller();
+        WebSocketPoller(const WebSocketPoller&) = delete;
+        WebSocketPoller& operator=(const WebSocketPoller&) = delete;
+        ~WebSocketPoller();
+
+        // the poll fd callbacks only fire when lws was built with LWS_WITH_EXTERNAL_POLL (lws_config.h),
+        // Init fails without it instead of leaving an fd that never becomes ready
+        static bool Supported();
+        int Init();
+        int GetFd();
+
+        // returns 1 if reason was a poll fd change and has been handled
+        int HandlePollCallback(lws_callback_reasons reason, void* in);
+        int Poll(lws_context* context);
+
+        // record a timer armed with lws_set_timer_usecs so GetTimeoutMs wakes the loop for it
+        void AddTimer(int64_t delay_us);
+        // wait for the external loop's epoll_wait: 0 when lws has work pending, otherwise the
+        // time to the next recorded timer, capped at max_ms for lws' own second granular timeouts
+        int GetTimeoutMs(lws_context* context, int max_ms = 1000);
+
+    private:
+        int epoll_fd_ = -1;
+        std::map<int, int> fd_events_;
+        std::multiset<int64_t> timers_us_;
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,153 @@
+#include "WebSocketRecorder.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "logger.h"
+
+// version 1 captures stored ts_ns relative to their own start
+#define CAPTURE_MAGIC "POCAWSC2"
+#define CAPTURE_MAGIC_V1 "POCAWSC1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_GROW_SIZE (64ll << 20)
+
+namespace poca_ws {
+    static int64_t CaptureNowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    WebSocketRecorder::WebSocketRecorder() {}
+
+    WebSocketRecorder::~WebSocketRecorder() { Close(); }
+
+    bool WebSocketRecorder::IsOpen() { return open_.load(std::memory_order_relaxed); }
+
+    int WebSocketRecorder::Open(const std::string& path) {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (fd_ >= 0) return -1;
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            poca_info("open capture file %s failed", path.c_str());
+            return -1;
+        }
+        offset_ = 0;
+        if (Grow(CAPTURE_MAGIC_SIZE) != 0) {
+            close(fd_);
+            fd_ = -1;
+            return -1;
+        }
+        memcpy(map_, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+        offset_ = CAPTURE_MAGIC_SIZE;
+        open_.store(true);
+        return 0;
+    }
+
+    int WebSocketRecorder::Grow(int64_t need) {
+        if (offset_ + need <= map_size_) return 0;
+        int64_t new_size = map_size_;
+        while (offset_ + need > new_size) {
+            new_size += CAPTURE_GROW_SIZE;
+        }
+        if (ftruncate(fd_, new_size) != 0) {
+            poca_info("grow capture file to %lld failed", (long long)new_size);
+            return -1;
+        }
+        if (map_ != nullptr) munmap(map_, map_size_);
+        map_ = (uint8_t*)mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (map_ == MAP_FAILED) {
+            poca_info("mmap capture file failed");
+            map_ = nullptr;
+            map_size_ = 0;
+            return -1;
+        }
+        map_size_ = new_size;
+        return 0;
+    }
+
+    int WebSocketRecorder::Append(int64_t user_id, int type, uint8_t* data, int len) {
+        std::unique_lock<std::mutex> lck(mux_);
+        if (fd_ < 0) return -1;
+        CaptureRecordHeader header;
+        header.ts_ns = CaptureNowNs();
+        header.user_id = user_id;
+        header.type = type;
+        header.len = len;
+        if (Grow(sizeof(header) + len) != 0) return -1;
+        memcpy(map_ + offset_, &header, sizeof(header));
+        if (len > 0) memcpy(map_ + offset_ + sizeof(header), data, len);
+        offset_ += sizeof(header) + len;
+        return 0;
+    }
+
+    void WebSocketRecorder::Close() {
+        std::unique_lock<std::mutex> lck(mux_);
+        open_.store(false);
+        if (fd_ < 0) return;
+        if (map_ != nullptr) munmap(map_, map_size_);
+        if (ftruncate(fd_, offset_) != 0) {
+            poca_info("truncate capture file failed");
+        }
+        close(fd_);
+        fd_ = -1;
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+
+    WebSocketCaptureReader::WebSocketCaptureReader() {}
+
+    WebSocketCaptureReader::~WebSocketCaptureReader() { Close(); }
+
+    int WebSocketCaptureReader::Open(const std::string& path) {
+        fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            poca_info("open capture file %s failed", path.c_str());
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || st.st_size < CAPTURE_MAGIC_SIZE) {
+            Close();
+            return -1;
+        }
+        map_size_ = st.st_size;
+        map_ = (uint8_t*)mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (map_ == MAP_FAILED) {
+            map_ = nullptr;
+            Close();
+            return -1;
+        }
+        if (memcmp(map_, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0 &&
+            memcmp(map_, CAPTURE_MAGIC_V1, CAPTURE_MAGIC_SIZE) != 0) {
+            poca_info("%s is not a capture file", path.c_str());
+            Close();
+            return -1;
+        }
+        offset_ = CAPTURE_MAGIC_SIZE;
+        return 0;
+    }
+
+    void WebSocketCaptureReader::Close() {
+        if (map_ != nullptr) munmap(map_, map_size_);
+        if (fd_ >= 0) close(fd_);
+        map_ = nullptr;
+        map_size_ = 0;
+        fd_ = -1;
+    }
+
+    bool WebSocketCaptureReader::Next(CaptureRecordHeader& header, uint8_t*& payload) {
+        if (map_ == nullptr || offset_ + (int64_t)sizeof(header) > map_size_) return false;
+        memcpy(&header, map_ + offset_, sizeof(header));
+        // a capture that was not closed cleanly ends in zeroed space
+        if (header.len < 0 || (header.ts_ns == 0 && header.user_id == 0)) return false;
+        if (offset_ + (int64_t)sizeof(header) + header.len > map_size_) return false;
+        payload = map_ + offset_ + sizeof(header);
+        offset_ += sizeof(header) + header.len;
+        return true;
+    }
+}  // namespace poca_ws
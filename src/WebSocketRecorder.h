@@ -0,0 +1,65 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_RECORDER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace poca_ws {
+    enum { CaptureText = 0, CaptureBinary };
+
+#pragma pack(push, 1)
+    struct CaptureRecordHeader {
+        int64_t ts_ns;  // steady_clock, so captures of one process, e.g. one per shard, share the origin
+        int64_t user_id;
+        int32_t type;
+        int32_t len;
+    };
+#pragma pack(pop)
+
+    // Appends inbound messages to a memory mapped capture file:
+    // 8 byte magic, then CaptureRecordHeader + payload per message.
+    class WebSocketRecorder {
+    public:
+        WebSocketRecorder();
+        WebSocketRecorder(const WebSocketRecorder&) = delete;
+        WebSocketRecorder& operator=(const WebSocketRecorder&) = delete;
+        ~WebSocketRecorder();
+
+        int Open(const std::string& path);
+        void Close();
+        bool IsOpen();
+        int Append(int64_t user_id, int type, uint8_t* data, int len);
+
+    private:
+        std::atomic_bool open_ = ATOMIC_VAR_INIT(false);
+        std::mutex mux_;
+        int fd_ = -1;
+        uint8_t* map_ = nullptr;
+        int64_t map_size_ = 0;
+        int64_t offset_ = 0;
+
+        int Grow(int64_t need);
+    };
+
+    class WebSocketCaptureReader {
+    public:
+        WebSocketCaptureReader();
+        WebSocketCaptureReader(const WebSocketCaptureReader&) = delete;
+        WebSocketCaptureReader& operator=(const WebSocketCaptureReader&) = delete;
+        ~WebSocketCaptureReader();
+
+        int Open(const std::string& path);
+        void Close();
+        // payload points into the mapped file and stays valid until Close
+        bool Next(CaptureRecordHeader& header, uint8_t*& payload);
+
+    private:
+        int fd_ = -1;
+        uint8_t* map_ = nullptr;
+        int64_t map_size_ = 0;
+        int64_t offset_ = 0;
+    };
+}  // namespace poca_ws
+#endif
@@ -1,10 +1,26 @@
 #include "WebSocketServer.h"
 
 #include <libwebsockets.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 
 #include "logger.h"
 
 #define MAX_PAYLOAD_SIZE 8192
+#define ACCEPT_BACKOFF_MS 100
+// a throttled ring reader checks this often whether its channel was shut down
+#define SHM_THROTTLE_SLICE_US 10000
 
 namespace poca_ws {
     std::map<lws_context*, WebSocketServer*> WebSocketServer::server_ptr_;
@@ -17,6 +33,38 @@ namespace poca_ws {
         ServerCallbackOnClose
     };
 
+    enum { SendLingerIdle = 0, SendLingerWaiting, SendLingerFired };
+
+    // encode a server to client (unmasked) frame header, returns header length
+    static int EncodeFrameHeader(uint8_t* header, int type, uint64_t len) {
+        header[0] = 0x80 | (type == LWS_WRITE_BINARY ? 0x2 : 0x1);
+        if (len < 126) {
+            header[1] = (uint8_t)len;
+            return 2;
+        }
+        if (len <= 0xffff) {
+            header[1] = 126;
+            header[2] = (uint8_t)(len >> 8);
+            header[3] = (uint8_t)len;
+            return 4;
+        }
+        header[1] = 127;
+        for (int i = 0; i < 8; ++i) {
+            header[2 + i] = (uint8_t)(len >> (8 * (7 - i)));
+        }
+        return 10;
+    }
+
+    static void PinCurrentThread(int cpu) {
+        if (cpu < 0) return;
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+            poca_info("pin thread to cpu %d failed", cpu);
+        }
+    }
+
     WebSocketServer::WebSocketServer(WebSocketServerListener& listener) { listener_ = &listener; }
 
     WebSocketServer::~WebSocketServer() {
@@ -30,12 +78,475 @@ namespace poca_ws {
         while (deque_send_buf_empty_.GetNoWait(receive_and_send_buf)) {
             if (receive_and_send_buf != nullptr) delete receive_and_send_buf;
         }
-        while (deque_send_buf_full_.GetNoWait(receive_and_send_buf)) {
-            if (receive_and_send_buf != nullptr) delete receive_and_send_buf;
+        for (auto& conn : send_queues_) {
+            for (auto buf : conn.second.frames) {
+                delete buf;
+            }
+        }
+        int fd;
+        while (adopt_fds_.GetNoWait(fd)) {
+            close(fd);
+        }
+    }
+
+    void WebSocketServer::SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+
+    void WebSocketServer::SetCpuAffinity(int cpu) { cpu_ = cpu; }
+
+    void WebSocketServer::SetSendBatching(int max_batch_bytes, int linger_us) {
+        max_batch_bytes_ = max_batch_bytes;
+        batch_linger_us_ = linger_us;
+    }
+
+    static int64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void WebSocketServer::SetRateLimit(double msgs_per_sec, double bytes_per_sec) {
+        conn_msgs_per_sec_ = msgs_per_sec;
+        conn_bytes_per_sec_ = bytes_per_sec;
+        rate_limited_ =
+            conn_msgs_per_sec_ > 0 || conn_bytes_per_sec_ > 0 || (global_limit_ && global_limit_->Enabled());
+    }
+
+    void WebSocketServer::SetGlobalRateLimit(double msgs_per_sec, double bytes_per_sec) {
+        SetGlobalRateLimit(std::make_shared<SharedRateLimit>(msgs_per_sec, bytes_per_sec));
+    }
+
+    void WebSocketServer::SetGlobalRateLimit(std::shared_ptr<SharedRateLimit> limit) {
+        global_limit_ = limit;
+        rate_limited_ =
+            conn_msgs_per_sec_ > 0 || conn_bytes_per_sec_ > 0 || (global_limit_ && global_limit_->Enabled());
+    }
+
+    void WebSocketServer::SetTraceSampling(int one_in_n) { tracer_.SetSampleRate(one_in_n); }
+
+    WebSocketTracer* WebSocketServer::GetTracer() { return &tracer_; }
+
+    void WebSocketServer::SetLocalTransport(bool enable) { local_transport_ = enable; }
+
+    static bool IsLoopbackPeer(lws* wsi) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (getpeername(lws_get_socket_fd(wsi), (sockaddr*)&addr, &len) != 0) return false;
+        if (addr.ss_family == AF_UNIX) return true;
+        if (addr.ss_family == AF_INET) {
+            return (ntohl(((sockaddr_in*)&addr)->sin_addr.s_addr) >> 24) == 127;
+        }
+        if (addr.ss_family == AF_INET6) {
+            in6_addr* addr6 = &((sockaddr_in6*)&addr)->sin6_addr;
+            return IN6_IS_ADDR_LOOPBACK(addr6) || (IN6_IS_ADDR_V4MAPPED(addr6) && addr6->s6_addr[12] == 127);
+        }
+        return false;
+    }
+
+    void WebSocketServer::OfferLocalTransport(lws* wsi) {
+        std::shared_ptr<WebSocketShmChannel> shm = std::make_shared<WebSocketShmChannel>();
+        std::string name;
+        if (shm->Create(name) != 0) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) return;
+            it->second.shm = shm;
+        }
+        shm_offered_.insert(wsi);
+        std::string offer = std::string(SHM_OFFER_MAGIC) + name;
+        SendMessage(int64_t(wsi), offer);
+    }
+
+    bool WebSocketServer::HandleLocalTransport(lws* wsi, WebSocketFrameBuffer* buf) {
+        // only a connection that was offered the ring and has not answered yet, without send_mux_
+        if (!local_transport_ || shm_offered_.count(wsi) == 0) return false;
+        std::string msg((char*)buf->GetPtr(), buf->GetLength());
+        if (msg != SHM_ACK_MAGIC && msg != SHM_NACK_MAGIC) {
+            return false;
+        }
+        shm_offered_.erase(wsi);
+        std::shared_ptr<WebSocketShmChannel> shm;
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) return true;
+            if (msg == SHM_NACK_MAGIC) {
+                it->second.shm.reset();
+                return true;
+            }
+            shm = it->second.shm;
+        }
+        shm->Unlink();
+        // everything queued so far, then the switch marker, goes over the websocket; the client
+        // starts reading the ring only after it sees the marker
+        {
+            WebSocketFrameBuffer* marker;
+            if (!deque_send_buf_empty_.GetNoWait(marker)) {
+                marker = new WebSocketFrameBuffer();
+            }
+            marker->Push(nullptr, LWS_PRE);
+            marker->Push((uint8_t*)SHM_SWITCH_MAGIC, strlen(SHM_SWITCH_MAGIC));
+            marker->SetUserId(int64_t(wsi));
+            marker->SetType(LWS_WRITE_TEXT);
+            std::unique_lock<std::mutex> lck(send_mux_);
+            send_queues_[wsi].frames.push_back(marker);
+            send_queues_[wsi].shm_marker = marker;
         }
+        lws_callback_on_writable(wsi);
+        int64_t user_id = int64_t(wsi);
+        // buckets are used by the reader thread only, the channel outlives it since Stop joins the reader
+        std::shared_ptr<ShmReader> reader = std::make_shared<ShmReader>();
+        reader->msgs.Init(conn_msgs_per_sec_, conn_msgs_per_sec_);
+        reader->bytes.Init(conn_bytes_per_sec_, conn_bytes_per_sec_);
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            SendQueue& queue = send_queues_[wsi];
+            reader->paused.store(queue.receive_paused);
+            queue.shm_reader = reader;
+        }
+        WebSocketShmChannel* channel = shm.get();
+        shm->Start([this, user_id, reader, channel](int type, uint8_t* data, int len) {
+            WebSocketFrameBuffer* on_receive;
+            if (!deque_receive_buf_empty_.GetNoWait(on_receive)) {
+                on_receive = new WebSocketFrameBuffer();
+            }
+            on_receive->Push(data, len);
+            on_receive->SetUserId(user_id);
+            on_receive->SetType(type == LWS_WRITE_BINARY ? ServerCallbackOnBinaryReceive : ServerCallbackOnTextReceive);
+            on_receive->SetTraced(tracer_.Sample());
+            tracer_.Stamp(on_receive, TraceReceive);
+            ReceiveShm(*reader, channel, on_receive);
+        });
+        poca_info("client [%p] switched to shared memory transport", wsi);
+        return true;
+    }
+
+    void WebSocketServer::ReceiveShm(ShmReader& reader, WebSocketShmChannel* shm, WebSocketFrameBuffer* buf) {
+        if (rate_limited_) {
+            ThrottleShmReceive(reader, shm, buf->GetLength());
+        }
+        if (recorder_.IsOpen()) {
+            recorder_.Append(buf->GetUserId(),
+                             buf->GetType() == ServerCallbackOnBinaryReceive ? CaptureBinary : CaptureText,
+                             buf->GetPtr(), buf->GetLength());
+        }
+        tracer_.Stamp(buf, TraceEnqueue);
+        // a paused reader holds the message it already took and leaves the rest in the ring
+        while (reader.paused.load() && !shm->IsClosed()) {
+            usleep(SHM_THROTTLE_SLICE_US);
+        }
+        if (!external_loop_) {
+            // the callback thread is the consumer, same as for socket input
+            deque_receive_buf_full_.Put(buf);
+            return;
+        }
+        shm_receive_.Put(buf);
+        if (!shm_wake_.exchange(true)) {
+            lws_cancel_service(context_);
+        }
+    }
+
+    void WebSocketServer::ThrottleShmReceive(ShmReader& reader, WebSocketShmChannel* shm, int bytes) {
+        int64_t now_us = NowUs();
+        int64_t wait_us = std::max(reader.msgs.Consume(1, now_us), reader.bytes.Consume(bytes, now_us));
+        if (global_limit_) {
+            wait_us = std::max(wait_us, global_limit_->Consume(1, bytes, now_us));
+        }
+        if (wait_us <= 0) return;
+        // the reader stops taking from the ring, so the peer backs up as on a paused socket
+        throttled_count_++;
+        throttled_connections_++;
+        while (wait_us > 0 && !shm->IsClosed()) {
+            usleep(std::min(wait_us, (int64_t)SHM_THROTTLE_SLICE_US));
+            now_us = NowUs();
+            wait_us = std::max(reader.msgs.WaitUs(now_us), reader.bytes.WaitUs(now_us));
+            if (global_limit_) {
+                wait_us = std::max(wait_us, global_limit_->WaitUs(now_us));
+            }
+        }
+        throttled_connections_--;
+    }
+
+    void WebSocketServer::DispatchShmReceive() {
+        // cleared first, a reader that puts after this wakes the loop again
+        shm_wake_.store(false);
+        WebSocketFrameBuffer* on_receive;
+        while (shm_receive_.GetNoWait(on_receive)) {
+            PostCallback(on_receive);
+        }
+    }
+
+    int WebSocketServer::StartRecording(const std::string& path) { return recorder_.Open(path); }
+
+    void WebSocketServer::StopRecording() { recorder_.Close(); }
+
+    int64_t WebSocketServer::GetThrottledCount() { return throttled_count_.load(); }
+
+    int WebSocketServer::GetThrottledConnections() { return throttled_connections_.load(); }
+
+    void WebSocketServer::SetThrottleTimer(lws* wsi, int64_t wait_us) {
+        // the lws timer is shared with the send linger and the ring retry, keep it from delaying
+        // a batch or a backlog that is waiting for it; the next TIMER re-arms the rest of the wait
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it != send_queues_.end() && it->second.linger == SendLingerWaiting) {
+                wait_us = std::min(wait_us, (int64_t)batch_linger_us_);
+            } else if (it != send_queues_.end() && it->second.shm_active && !it->second.frames.empty()) {
+                wait_us = std::min(wait_us, (int64_t)SHM_RETRY_US);
+            }
+        }
+        SetTimer(wsi, wait_us);
+    }
+
+    void WebSocketServer::SetTimer(lws* wsi, int64_t delay_us) {
+        lws_set_timer_usecs(wsi, delay_us);
+        if (external_loop_) {
+            poller_.AddTimer(delay_us);
+        }
+    }
+
+    void WebSocketServer::ThrottleReceive(lws* wsi, int msgs, int bytes) {
+        auto it = rate_limits_.find(wsi);
+        if (it == rate_limits_.end()) {
+            it = rate_limits_.emplace(wsi, ConnRateLimit()).first;
+            it->second.msgs.Init(conn_msgs_per_sec_, conn_msgs_per_sec_);
+            it->second.bytes.Init(conn_bytes_per_sec_, conn_bytes_per_sec_);
+        }
+        ConnRateLimit& limit = it->second;
+        int64_t now_us = NowUs();
+        int64_t wait_us = std::max(limit.msgs.Consume(msgs, now_us), limit.bytes.Consume(bytes, now_us));
+        if (global_limit_) {
+            wait_us = std::max(wait_us, global_limit_->Consume(msgs, bytes, now_us));
+        }
+        if (wait_us > 0 && !limit.throttled) {
+            limit.throttled = true;
+            throttled_count_++;
+            throttled_connections_++;
+            lws_rx_flow_control(wsi, 0);
+            SetThrottleTimer(wsi, wait_us);
+        }
+    }
+
+    void WebSocketServer::ResumeReceive(lws* wsi) {
+        auto it = rate_limits_.find(wsi);
+        if (it == rate_limits_.end() || !it->second.throttled) {
+            return;
+        }
+        ConnRateLimit& limit = it->second;
+        int64_t now_us = NowUs();
+        int64_t wait_us = std::max(limit.msgs.WaitUs(now_us), limit.bytes.WaitUs(now_us));
+        if (global_limit_) {
+            wait_us = std::max(wait_us, global_limit_->WaitUs(now_us));
+        }
+        if (wait_us > 0) {
+            SetThrottleTimer(wsi, wait_us);
+            return;
+        }
+        limit.throttled = false;
+        throttled_connections_--;
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto queue = send_queues_.find(wsi);
+            if (queue != send_queues_.end() && queue->second.receive_paused) return;
+        }
+        lws_rx_flow_control(wsi, 1);
+    }
+
+    int WebSocketServer::PauseReceive(int64_t user_id, bool paused) {
+        lws* wsi = (lws*)user_id;
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) return -1;
+            if (it->second.receive_paused == paused) return 0;
+            it->second.receive_paused = paused;
+            if (it->second.shm_reader) {
+                it->second.shm_reader->paused.store(paused);
+            }
+            receive_pause_changed_.insert(wsi);
+        }
+        lws_cancel_service(context_);
+        return 0;
+    }
+
+    void WebSocketServer::ApplyReceivePause() {
+        std::set<lws*> changed;
+        std::map<lws*, bool> paused;
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            changed.swap(receive_pause_changed_);
+            for (auto wsi : changed) {
+                auto it = send_queues_.find(wsi);
+                if (it != send_queues_.end()) {
+                    paused[wsi] = it->second.receive_paused;
+                }
+            }
+        }
+        for (auto& entry : paused) {
+            auto limit = rate_limits_.find(entry.first);
+            if (limit != rate_limits_.end() && limit->second.throttled) {
+                // ResumeReceive checks receive_paused before reading again
+                continue;
+            }
+            lws_rx_flow_control(entry.first, entry.second ? 0 : 1);
+        }
+    }
+
+    int WebSocketServer::WriteShm(SendQueue& queue) {
+        while (!queue.frames.empty()) {
+            WebSocketFrameBuffer* frame = queue.frames.front();
+            int ret = queue.shm->Write(frame->GetType(), frame->GetPtr() + LWS_PRE, frame->GetLength() - LWS_PRE,
+                                       queue.shm_offset);
+            if (ret == SHM_RING_FULL) {
+                if (queue.shm_offset > 0 && !frame->GetKey().empty()) {
+                    // partly in the ring already, a newer value can no longer replace it
+                    queue.conflated.erase(frame->GetKey());
+                    frame->SetKey("");
+                }
+                return SHM_RING_FULL;
+            }
+            queue.frames.pop_front();
+            queue.shm_offset = 0;
+            if (!frame->GetKey().empty()) {
+                queue.conflated.erase(frame->GetKey());
+            }
+            tracer_.Stamp(frame, TraceWrite);
+            tracer_.Record(frame);
+            frame->Clear();
+            deque_send_buf_empty_.Put(frame);
+        }
+        return 0;
+    }
+
+    int WebSocketServer::WriteQueued(lws* wsi) {
+        bool more = false;
+        bool switched = false;
+        int pending = 0;
+        int shm_ret = -1;
+        batch_frames_.clear();
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) {
+                return 0;
+            }
+            if (it->second.frames.empty()) {
+                if (going_away_.load()) {
+                    lws_close_reason(wsi, LWS_CLOSE_STATUS_GOINGAWAY, (unsigned char*)"going away", 10);
+                    return -1;
+                }
+                return 0;
+            }
+            SendQueue& queue = it->second;
+            if (queue.shm_active) {
+                shm_ret = WriteShm(queue);
+                pending = (int)queue.frames.size();
+            }
+        }
+        if (shm_ret != -1) {
+            if (shm_ret == SHM_RING_FULL) {
+                if (going_away_.load()) {
+                    // the flush phase of the drain is over
+                    lws_close_reason(wsi, LWS_CLOSE_STATUS_GOINGAWAY, (unsigned char*)"going away", 10);
+                    return -1;
+                }
+                SetTimer(wsi, SHM_RETRY_US);
+            } else if (going_away_.load()) {
+                lws_callback_on_writable(wsi);
+            }
+            if (write_callback_) {
+                write_callback_(int64_t(wsi), pending);
+            }
+            return 0;
+        }
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) {
+                return 0;
+            }
+            SendQueue& queue = it->second;
+            if (max_batch_bytes_ > 0 && batch_linger_us_ > 0 && queue.linger != SendLingerFired && !draining_.load()) {
+                int pending_bytes = 0;
+                for (auto frame : queue.frames) {
+                    pending_bytes += frame->GetLength() - LWS_PRE;
+                    if (pending_bytes >= max_batch_bytes_) break;
+                }
+                if (pending_bytes < max_batch_bytes_) {
+                    if (queue.linger == SendLingerIdle) {
+                        queue.linger = SendLingerWaiting;
+                        SetTimer(wsi, batch_linger_us_);
+                    }
+                    return 0;
+                }
+            }
+            queue.linger = SendLingerIdle;
+            int batch_bytes = 0;
+            while (!queue.frames.empty()) {
+                WebSocketFrameBuffer* frame = queue.frames.front();
+                int frame_bytes = frame->GetLength() - LWS_PRE;
+                if (!batch_frames_.empty() && (max_batch_bytes_ <= 0 || batch_bytes + frame_bytes > max_batch_bytes_)) {
+                    break;
+                }
+                queue.frames.pop_front();
+                if (!frame->GetKey().empty()) {
+                    queue.conflated.erase(frame->GetKey());
+                }
+                batch_frames_.push_back(frame);
+                batch_bytes += frame_bytes;
+                if (frame == queue.shm_marker) {
+                    switched = true;
+                    break;
+                }
+            }
+            pending = (int)queue.frames.size();
+            more = pending > 0;
+        }
+
+        if (batch_frames_.size() == 1) {
+            WebSocketFrameBuffer* msg_submit = batch_frames_[0];
+            lws_write(wsi, msg_submit->GetPtr() + LWS_PRE, msg_submit->GetLength() - LWS_PRE,
+                      (lws_write_protocol)msg_submit->GetType());
+        } else {
+            // several small frames encoded back to back and flushed with one write
+            uint8_t header[10];
+            batch_buf_.Clear();
+            for (auto frame : batch_frames_) {
+                int frame_bytes = frame->GetLength() - LWS_PRE;
+                batch_buf_.Push(header, EncodeFrameHeader(header, frame->GetType(), frame_bytes));
+                batch_buf_.Push(frame->GetPtr() + LWS_PRE, frame_bytes);
+            }
+            lws_write(wsi, batch_buf_.GetPtr(), batch_buf_.GetLength(), LWS_WRITE_RAW);
+        }
+        for (auto frame : batch_frames_) {
+            tracer_.Stamp(frame, TraceWrite);
+            tracer_.Record(frame);
+            frame->Clear();
+            deque_send_buf_empty_.Put(frame);
+        }
+        if (switched) {
+            // the peer reads the ring from the marker on, so do later frames
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it != send_queues_.end()) {
+                it->second.shm_marker = nullptr;
+                it->second.shm_active = true;
+            }
+        }
+        if (more || going_away_.load()) {
+            lws_callback_on_writable(wsi);
+        }
+        if (write_callback_) {
+            write_callback_(int64_t(wsi), pending);
+        }
+        return 0;
     }
 
     void WebSocketServer::CallbackEventLoop() {
+        PinCurrentThread(cpu_);
         WebSocketFrameBuffer* buf;
         while (true) {
             if (close_.load()) break;
@@ -43,25 +554,42 @@ namespace poca_ws {
             if (buf == nullptr) {
                 continue;
             }
-            switch (buf->GetType()) {
-                case ServerCallbackOnBinaryReceive:
-                    listener_->OnBinary(buf->GetUserId(), buf->GetPtr(), buf->GetLength());
-                    break;
-                case ServerCallbackOnTextReceive: {
-                    std::string msg((char*)buf->GetPtr());
-                    listener_->OnText(buf->GetUserId(), msg);
-                } break;
-                case ServerCallbackOnConnect:
-                    listener_->OnConnect(buf->GetUserId());
-                    break;
-                case ServerCallbackOnClose:
-                    listener_->OnClose(buf->GetUserId());
-                    break;
-                default:
-                    break;
-            }
-            buf->Clear();
-            deque_receive_buf_empty_.Put(buf);
+            tracer_.Stamp(buf, TraceDequeue);
+            DispatchCallback(buf);
+        }
+    }
+
+    void WebSocketServer::DispatchCallback(WebSocketFrameBuffer* buf) {
+        tracer_.Stamp(buf, TraceCallbackStart);
+        switch (buf->GetType()) {
+            case ServerCallbackOnBinaryReceive:
+                listener_->OnBinary(buf->GetUserId(), buf->GetPtr(), buf->GetLength());
+                break;
+            case ServerCallbackOnTextReceive: {
+                std::string msg((char*)buf->GetPtr());
+                listener_->OnText(buf->GetUserId(), msg);
+            } break;
+            case ServerCallbackOnConnect:
+                listener_->OnConnect(buf->GetUserId());
+                break;
+            case ServerCallbackOnClose:
+                listener_->OnClose(buf->GetUserId());
+                break;
+            default:
+                break;
+        }
+        tracer_.Stamp(buf, TraceCallbackEnd);
+        tracer_.Record(buf);
+        buf->Clear();
+        deque_receive_buf_empty_.Put(buf);
+    }
+
+    void WebSocketServer::PostCallback(WebSocketFrameBuffer* buf) {
+        if (external_loop_) {
+            tracer_.Stamp(buf, TraceDequeue);
+            DispatchCallback(buf);
+        } else {
+            deque_receive_buf_full_.Put(buf);
         }
     }
 
@@ -74,6 +602,10 @@ namespace poca_ws {
             server = server_ptr_[context];
         }
         server_ptr_mux_.unlock();
+        if (server == nullptr && context != nullptr) {
+            // callbacks fired inside lws_create_context, before the context is registered
+            server = (WebSocketServer*)lws_context_user(context);
+        }
         if (server == nullptr) {
             return lws_callback_http_dummy(wsi, reason, user, in, len);
         } else {
@@ -84,9 +616,19 @@ namespace poca_ws {
     int WebSocketServer::LwsClientCallback(lws* wsi, lws_callback_reasons reason, void* user, void* in, size_t len) {
         // poca_info("LwsClientCallback, wsi: %p, reason: %d", wsi, reason);
         int64_t user_id = int64_t(wsi);
+        if (external_loop_ && poller_.HandlePollCallback(reason, in)) {
+            return 0;
+        }
         switch (reason) {
             case LWS_CALLBACK_ESTABLISHED:
                 poca_info("client [%p] connect", wsi);
+                {
+                    std::unique_lock<std::mutex> lck(send_mux_);
+                    send_queues_[wsi];
+                }
+                if (shm_requested_.erase(wsi)) {
+                    OfferLocalTransport(wsi);
+                }
                 {
                     WebSocketFrameBuffer* on_connect;
                     if (!deque_receive_buf_empty_.GetNoWait(on_connect)) {
@@ -94,11 +636,41 @@ namespace poca_ws {
                     }
                     on_connect->SetUserId(user_id);
                     on_connect->SetType(ServerCallbackOnConnect);
-                    deque_receive_buf_full_.Put(on_connect);
+                    PostCallback(on_connect);
                 }
                 break;
             case LWS_CALLBACK_CLOSED:
                 poca_info("client connect close, wsi: %p", wsi);
+                shm_requested_.erase(wsi);
+                shm_offered_.erase(wsi);
+                {
+                    std::shared_ptr<WebSocketShmChannel> shm;
+                    {
+                        std::unique_lock<std::mutex> lck(send_mux_);
+                        auto it = send_queues_.find(wsi);
+                        if (it != send_queues_.end()) {
+                            for (auto buf : it->second.frames) {
+                                buf->Clear();
+                                deque_send_buf_empty_.Put(buf);
+                            }
+                            shm.swap(it->second.shm);
+                            send_queues_.erase(it);
+                        }
+                        receive_pause_changed_.erase(wsi);
+                    }
+                    if (shm) {
+                        // what the reader took from the ring before it stopped goes ahead of OnClose
+                        shm->Stop();
+                        DispatchShmReceive();
+                    }
+                }
+                {
+                    auto it = rate_limits_.find(wsi);
+                    if (it != rate_limits_.end()) {
+                        if (it->second.throttled) throttled_connections_--;
+                        rate_limits_.erase(it);
+                    }
+                }
                 {
                     WebSocketFrameBuffer* on_close;
                     if (!deque_receive_buf_empty_.GetNoWait(on_close)) {
@@ -106,7 +678,7 @@ namespace poca_ws {
                     }
                     on_close->SetUserId(user_id);
                     on_close->SetType(ServerCallbackOnClose);
-                    deque_receive_buf_full_.Put(on_close);
+                    PostCallback(on_close);
                 }
                 break;
             case LWS_CALLBACK_RECEIVE: {
@@ -114,35 +686,83 @@ namespace poca_ws {
                 int final = lws_is_final_fragment(wsi);
                 int is_binary = lws_frame_is_binary(wsi);
                 // poca_info("Receive, wsi: %p, len: %d, first: %d, final: %d", wsi, len, first, final);
+                if (rate_limited_) {
+                    ThrottleReceive(wsi, first ? 1 : 0, (int)len);
+                }
                 WebSocketFrameBuffer* on_receive;
                 if (first) {
                     if (!deque_receive_buf_empty_.GetNoWait(on_receive)) {
                         on_receive = new WebSocketFrameBuffer();
                     }
                     on_receive->Clear();
+                    on_receive->SetTraced(tracer_.Sample());
+                    tracer_.Stamp(on_receive, TraceReceive);
                     receive_buf_internal_[wsi] = on_receive;
                 } else {
                     on_receive = receive_buf_internal_[wsi];
                 }
                 on_receive->Push((uint8_t*)in, len);
-                if (final) {
+                if (final && HandleLocalTransport(wsi, on_receive)) {
+                    on_receive->Clear();
+                    deque_receive_buf_empty_.Put(on_receive);
+                } else if (final) {
                     on_receive->SetUserId(user_id);
                     if (is_binary) {
                         on_receive->SetType(ServerCallbackOnBinaryReceive);
                     } else {
                         on_receive->SetType(ServerCallbackOnTextReceive);
                     }
-                    deque_receive_buf_full_.Put(on_receive);
+                    if (recorder_.IsOpen()) {
+                        recorder_.Append(user_id, is_binary ? CaptureBinary : CaptureText, on_receive->GetPtr(),
+                                         on_receive->GetLength());
+                    }
+                    tracer_.Stamp(on_receive, TraceEnqueue);
+                    PostCallback(on_receive);
+                }
+            } break;
+            case LWS_CALLBACK_SERVER_WRITEABLE:
+                return WriteQueued(wsi);
+            case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
+                // only reached when lws owns the listening socket, which a draining server cannot
+                // close, so it refuses instead
+                if (draining_.load()) return -1;
+                break;
+            case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+                // only a peer on this host can map the segment, others are never offered one
+                if (local_transport_ &&
+                    lws_hdr_custom_length(wsi, SHM_REQUEST_HEADER, strlen(SHM_REQUEST_HEADER)) > 0 &&
+                    IsLoopbackPeer(wsi)) {
+                    shm_requested_.insert(wsi);
+                }
+                break;
+            case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+                int fd;
+                lws_vhost* vhost = lws_get_vhost_by_name(context_, "default");
+                while (adopt_fds_.GetNoWait(fd)) {
+                    if (draining_.load() || lws_adopt_socket_vhost(vhost, fd) == nullptr) {
+                        close(fd);
+                    }
                 }
+                DispatchShmReceive();
+                ApplyReceivePause();
             } break;
-            case LWS_CALLBACK_SERVER_WRITEABLE: {
-                WebSocketFrameBuffer* msg_submit;
-                if (deque_send_buf_full_.GetNoWait(msg_submit)) {
-                    lws_write(wsi, msg_submit->GetPtr() + LWS_PRE, msg_submit->GetLength(),
-                              (lws_write_protocol)msg_submit->GetType());
-                    msg_submit->Clear();
-                    deque_send_buf_empty_.Put(msg_submit);
+            case LWS_CALLBACK_TIMER: {
+                bool linger_fired = false;
+                {
+                    std::unique_lock<std::mutex> lck(send_mux_);
+                    auto it = send_queues_.find(wsi);
+                    if (it != send_queues_.end() && it->second.linger == SendLingerWaiting) {
+                        it->second.linger = SendLingerFired;
+                        linger_fired = true;
+                    } else if (it != send_queues_.end() && it->second.shm_active && !it->second.frames.empty()) {
+                        // retry of a full ring
+                        linger_fired = true;
+                    }
                 }
+                if (linger_fired) {
+                    lws_callback_on_writable(wsi);
+                }
+                ResumeReceive(wsi);
             } break;
             default:
                 break;
@@ -150,7 +770,7 @@ namespace poca_ws {
         return 0;
     }
 
-    int WebSocketServer::ListenAndServe(int port) {
+    int WebSocketServer::CreateContext(int port) {
         port_ = port;
         static const lws_protocols protocols[] = {{
                                                       "ws",
@@ -162,8 +782,12 @@ namespace poca_ws {
         lws_context_creation_info ctx_info = {0};
         ctx_info.port = port_;
         ctx_info.protocols = protocols;
+        ctx_info.user = this;
         ctx_info.options =
             LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE | LWS_SERVER_OPTION_VALIDATE_UTF8;
+        if (reuse_port_) {
+            ctx_info.options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+        }
 
         context_ = lws_create_context(&ctx_info);
         if (!context_) {
@@ -172,60 +796,300 @@ namespace poca_ws {
         server_ptr_mux_.lock();
         server_ptr_[context_] = this;
         server_ptr_mux_.unlock();
+        return 0;
+    }
+
+    void WebSocketServer::DestroyContext() {
+        lws_context_destroy(context_);
+        server_ptr_mux_.lock();
+        server_ptr_.erase(context_);
+        server_ptr_mux_.unlock();
+    }
 
+    int WebSocketServer::ListenAndServe(int port) {
+        PinCurrentThread(cpu_);
+
+        if (CreateContext(port) != 0) {
+            return -1;
+        }
+        return Serve();
+    }
+
+    int WebSocketServer::ListenAndServeFd(int listen_fd) {
+        PinCurrentThread(cpu_);
+
+        // another process may share the socket and win a connection both were woken for
+        int flags = fcntl(listen_fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            close(listen_fd);
+            return -1;
+        }
+        if (CreateContext(CONTEXT_PORT_NO_LISTEN_SERVER) != 0) {
+            close(listen_fd);
+            return -1;
+        }
+        accept_wake_fd_ = eventfd(0, EFD_CLOEXEC);
+        if (accept_wake_fd_ < 0) {
+            close(listen_fd);
+            DestroyContext();
+            return -1;
+        }
+        listen_fd_ = listen_fd;
+        accept_thread_ = std::thread(&WebSocketServer::AcceptLoop, this);
+        return Serve();
+    }
+
+    int WebSocketServer::Serve() {
         callback_thread_ = std::thread(&WebSocketServer::CallbackEventLoop, this);
 
         while (!close_.load()) {
             lws_service(context_, 0);
             cv_.notify_all();
         }
-        lws_context_destroy(context_);
-        server_ptr_mux_.lock();
-        server_ptr_.erase(context_);
-        server_ptr_mux_.unlock();
+        callback_thread_.join();
+        StopAccept();
+        DestroyContext();
         return 0;
     }
 
-    int WebSocketServer::SendMessage(int64_t user_id, std::string& msg) {
-        lws* wsi = (lws*)user_id;
-        WebSocketFrameBuffer* msg_frame;
-        if (!deque_send_buf_empty_.GetNoWait(msg_frame)) {
-            msg_frame = new WebSocketFrameBuffer();
+    void WebSocketServer::AcceptLoop() {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {accept_wake_fd_, POLLIN, 0}};
+        int nfds = 2;
+        while (true) {
+            // while out of fds only the wake fd is watched, for a short back off
+            if (poll(nfds == 2 ? fds : fds + 1, nfds, nfds == 2 ? -1 : ACCEPT_BACKOFF_MS) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents) break;
+            if (nfds == 1) {
+                nfds = 2;
+                continue;
+            }
+            if (!(fds[0].revents & POLLIN)) continue;
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0) {
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    poca_info("accept failed: %s, backing off", strerror(errno));
+                    nfds = 1;
+                }
+                // EAGAIN: the connection went to another process sharing the socket
+                continue;
+            }
+            // lws wsis may only be created on the service thread
+            adopt_fds_.Put(fd);
+            lws_cancel_service(context_);
         }
-        msg_frame->Push(nullptr, LWS_PRE);
-        msg_frame->Push((uint8_t*)msg.c_str(), (int)msg.size());
-        msg_frame->SetUserId(user_id);
-        msg_frame->SetType(LWS_WRITE_TEXT);
+    }
 
-        deque_send_buf_full_.Put(msg_frame);
-        lws_callback_on_writable(wsi);
-        lws_cancel_service(context_);
+    void WebSocketServer::StopAccept() {
+        std::unique_lock<std::mutex> lck(accept_mux_);
+        if (accept_wake_fd_ < 0) return;
+        uint64_t one = 1;
+        if (write(accept_wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+            poca_info("wake accept thread failed");
+        }
+        accept_thread_.join();
+        close(accept_wake_fd_);
+        accept_wake_fd_ = -1;
+        // the socket stays open in whichever process it was handed to
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
 
-        return 0;
+    bool WebSocketServer::WaitDrain(std::chrono::steady_clock::time_point deadline, std::function<bool(void)> done) {
+        while (!done()) {
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            std::unique_lock<std::mutex> lck(mux_);
+            cv_.wait_for(lck, std::chrono::milliseconds(10));
+        }
+        return true;
     }
 
-    int WebSocketServer::SendBinary(int64_t user_id, uint8_t* data, int len) {
-        lws* wsi = (lws*)user_id;
-        WebSocketFrameBuffer* msg_frame;
-        if (!deque_send_buf_empty_.GetNoWait(msg_frame)) {
+    int WebSocketServer::Drain(int timeout_ms) {
+        if (external_loop_) {
+            poca_info("drain is not supported on an external loop, closing");
+            Close();
+            return -1;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        draining_.store(true);
+        StopAccept();
+
+        bool flushed = WaitDrain(deadline, [&]() {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            for (auto& conn : send_queues_) {
+                if (!conn.second.frames.empty()) return false;
+                if (conn.second.shm && conn.second.shm->GetPendingBytes() > 0) return false;
+            }
+            return true;
+        });
+
+        going_away_.store(true);
+        {
+            // armed under the lock, LWS_CALLBACK_CLOSED takes it before a wsi is freed
+            std::unique_lock<std::mutex> lck(send_mux_);
+            for (auto& conn : send_queues_) {
+                lws_callback_on_writable(conn.first);
+            }
+        }
+        if (context_ != nullptr) lws_cancel_service(context_);
+        bool closed = WaitDrain(deadline, [&]() {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            return send_queues_.empty();
+        });
+
+        Close();
+        return flushed && closed ? 0 : -1;
+    }
+
+    int WebSocketServer::Listen(int port) {
+        if (poller_.Init() != 0) {
+            return -1;
+        }
+        external_loop_ = true;
+        return CreateContext(port);
+    }
+
+    int WebSocketServer::GetPollFd() { return poller_.GetFd(); }
+
+    int WebSocketServer::Poll() {
+        if (context_ == nullptr) return -1;
+        return poller_.Poll(context_);
+    }
+
+    int WebSocketServer::GetNextTimeoutMs() {
+        if (context_ == nullptr) return -1;
+        return poller_.GetTimeoutMs(context_);
+    }
+
+    int WebSocketServer::QueueFrame(lws* wsi, SendQueue& queue, uint8_t* data, int len, int type,
+                                    const std::string& key) {
+        int offset = 0;
+        if (queue.shm_active && queue.frames.empty()) {
+            // straight into the ring, the queue only keeps what does not fit
+            int ret = queue.shm->Write(type, data, len, offset);
+            if (ret != SHM_RING_FULL) {
+                return ret;
+            }
+        }
+        WebSocketFrameBuffer* msg_frame = nullptr;
+        if (!key.empty()) {
+            auto pending = queue.conflated.find(key);
+            if (pending != queue.conflated.end()) {
+                msg_frame = pending->second;
+                msg_frame->Clear();
+            }
+        }
+        bool replaced = msg_frame != nullptr;
+        if (!replaced && !deque_send_buf_empty_.GetNoWait(msg_frame)) {
             msg_frame = new WebSocketFrameBuffer();
         }
         msg_frame->Push(nullptr, LWS_PRE);
         msg_frame->Push(data, len);
-        msg_frame->SetUserId(user_id);
-        msg_frame->SetType(LWS_WRITE_BINARY);
+        msg_frame->SetUserId(int64_t(wsi));
+        msg_frame->SetType(type);
+        // a frame partly in the ring can no longer be replaced
+        msg_frame->SetKey(offset > 0 ? "" : key);
+        msg_frame->SetTraced(tracer_.Sample());
+        tracer_.Stamp(msg_frame, TraceSendEnqueue);
+        if (replaced) {
+            return 0;
+        }
+        queue.frames.push_back(msg_frame);
+        if (offset > 0) {
+            queue.shm_offset = offset;
+        }
+        if (!msg_frame->GetKey().empty()) {
+            queue.conflated[key] = msg_frame;
+        }
+        return 1;
+    }
 
-        deque_send_buf_full_.Put(msg_frame);
-        lws_callback_on_writable(wsi);
+    int WebSocketServer::SendFrame(int64_t user_id, uint8_t* data, int len, int type, const std::string& key) {
+        lws* wsi = (lws*)user_id;
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            auto it = send_queues_.find(wsi);
+            if (it == send_queues_.end()) {
+                return -1;
+            }
+            int ret = QueueFrame(wsi, it->second, data, len, type, key);
+            if (ret != 1) {
+                return ret;
+            }
+            // armed under the lock, LWS_CALLBACK_CLOSED takes it before the wsi is freed
+            lws_callback_on_writable(wsi);
+        }
+        lws_cancel_service(context_);
+
+        return 0;
+    }
+
+    int WebSocketServer::BroadcastFrame(uint8_t* data, int len, int type) {
+        {
+            std::unique_lock<std::mutex> lck(send_mux_);
+            for (auto& conn : send_queues_) {
+                if (QueueFrame(conn.first, conn.second, data, len, type, "") == 1) {
+                    lws_callback_on_writable(conn.first);
+                }
+            }
+        }
         lws_cancel_service(context_);
 
         return 0;
     }
 
+    int WebSocketServer::SendMessage(int64_t user_id, std::string& msg) {
+        return SendFrame(user_id, (uint8_t*)msg.c_str(), (int)msg.size(), LWS_WRITE_TEXT);
+    }
+
+    int WebSocketServer::SendBinary(int64_t user_id, uint8_t* data, int len) {
+        return SendFrame(user_id, data, len, LWS_WRITE_BINARY);
+    }
+
+    int WebSocketServer::SendConflated(int64_t user_id, const std::string& key, std::string& msg) {
+        return SendFrame(user_id, (uint8_t*)msg.c_str(), (int)msg.size(), LWS_WRITE_TEXT, key);
+    }
+
+    int WebSocketServer::SendConflatedBinary(int64_t user_id, const std::string& key, uint8_t* data, int len) {
+        return SendFrame(user_id, data, len, LWS_WRITE_BINARY, key);
+    }
+
+    int WebSocketServer::Broadcast(std::string& msg) {
+        return BroadcastFrame((uint8_t*)msg.c_str(), (int)msg.size(), LWS_WRITE_TEXT);
+    }
+
+    int WebSocketServer::BroadcastBinary(uint8_t* data, int len) {
+        return BroadcastFrame(data, len, LWS_WRITE_BINARY);
+    }
+
+    bool WebSocketServer::HasUser(int64_t user_id) {
+        std::unique_lock<std::mutex> lck(send_mux_);
+        return send_queues_.count((lws*)user_id) > 0;
+    }
+
+    int WebSocketServer::GetPendingSendNum(int64_t user_id) {
+        std::unique_lock<std::mutex> lck(send_mux_);
+        auto it = send_queues_.find((lws*)user_id);
+        return it == send_queues_.end() ? -1 : (int)it->second.frames.size();
+    }
+
+    void WebSocketServer::SetWriteCallback(std::function<void(int64_t user_id, int pending)> callback) {
+        write_callback_ = callback;
+    }
+
     void WebSocketServer::Close() {
         close_.store(true);
+        if (external_loop_) {
+            if (context_ != nullptr) {
+                DestroyContext();
+                context_ = nullptr;
+            }
+            return;
+        }
         WebSocketFrameBuffer* none = nullptr;
         deque_receive_buf_full_.Put(none);
-        lws_cancel_service(context_);
+        if (context_ != nullptr) lws_cancel_service(context_);
     }
 }  // namespace poca_ws
\ No newline at end of file
@@ -2,16 +2,26 @@
 #define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_CLIENT_H
 
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "WebSocketFrameBuffer.h"
+#include "WebSocketPoller.h"
+#include "WebSocketRecorder.h"
 #include "WebSocketServerListener.h"
+#include "WebSocketShmChannel.h"
+#include "WebSocketTracer.h"
 #include "libwebsockets.h"
 #include "sync_deque.h"
+#include "token_bucket.h"
 
 namespace poca_ws {
     class WebSocketServer {
@@ -23,32 +33,180 @@ namespace poca_ws {
         ~WebSocketServer();
 
         int ListenAndServe(int port);
+        // serve on an already listening socket, e.g. one created by PocaSocket::CreateListenSocket or
+        // received from a draining process with PocaSocket::ReceiveListenSocket. The server owns it
+        int ListenAndServeFd(int listen_fd);
         void Close();
+        // stop taking connections, flush the send queues, close every connection with 1001 "going
+        // away" and then Close(). After ListenAndServeFd this process' listening socket is closed, so
+        // new connections wait in the backlog of a process the socket was handed to; after
+        // ListenAndServe lws owns the socket and new connections are refused.
+        // returns -1 if timeout_ms passed before all connections were closed
+        int Drain(int timeout_ms);
+
+        // Attach to an externally owned loop instead of ListenAndServe: watch GetPollFd() for
+        // readability and call Poll() from the loop thread when it fires or when GetNextTimeoutMs()
+        // passes, pass it as the epoll_wait timeout. Listener callbacks run inside Poll(); Close()
+        // must be called from the loop thread too. -1 when lws was built without LWS_WITH_EXTERNAL_POLL
+        int Listen(int port);
+        int GetPollFd();
+        int Poll();
+        int GetNextTimeoutMs();
 
         int SendMessage(int64_t user_id, std::string& msg);
         int SendBinary(int64_t user_id, uint8_t* data, int len);
+        int Broadcast(std::string& msg);
+        int BroadcastBinary(uint8_t* data, int len);
+        // a not yet written message with the same key is replaced in place
+        int SendConflated(int64_t user_id, const std::string& key, std::string& msg);
+        int SendConflatedBinary(int64_t user_id, const std::string& key, uint8_t* data, int len);
+        bool HasUser(int64_t user_id);
+        // frames queued for the user and not yet written, -1 for an unknown user
+        int GetPendingSendNum(int64_t user_id);
+        // called on the service thread after each write to a user, must not block. Set before ListenAndServe
+        void SetWriteCallback(std::function<void(int64_t user_id, int pending)> callback);
+        // stop or restart reading from the user, e.g. while the application cannot keep up.
+        // Applied on the service thread, -1 for an unknown user
+        int PauseReceive(int64_t user_id, bool paused);
+
+        // must be called before ListenAndServe
+        void SetReusePort(bool reuse_port);
+        void SetCpuAffinity(int cpu);
+        // coalesce queued frames up to max_batch_bytes into one write, optionally waiting
+        // up to linger_us for a batch to fill. max_batch_bytes <= 0 disables batching
+        void SetSendBatching(int max_batch_bytes, int linger_us = 0);
+        // token bucket limits on inbound messages/bytes, per connection and for the whole server.
+        // reads of a connection over budget are paused until the bucket refills. 0 means unlimited
+        void SetRateLimit(double msgs_per_sec, double bytes_per_sec);
+        void SetGlobalRateLimit(double msgs_per_sec, double bytes_per_sec);
+        // one budget shared with other servers, e.g. the shards of a WebSocketServerGroup
+        void SetGlobalRateLimit(std::shared_ptr<SharedRateLimit> limit);
+
+        int64_t GetThrottledCount();
+        int GetThrottledConnections();
+
+        // trace one message in every one_in_n through receive/callback/send stages, 0 disables
+        void SetTraceSampling(int one_in_n);
+        WebSocketTracer* GetTracer();
+
+        // capture inbound messages for poca-ws-replay
+        int StartRecording(const std::string& path);
+        void StopRecording();
+
+        // let clients on the same host that ask for it exchange messages through shared memory
+        // rings instead of the socket, the websocket stays open as the control connection
+        void SetLocalTransport(bool enable);
 
     private:
         WebSocketServerListener* listener_;
 
         int port_;
+        bool reuse_port_ = false;
+        int cpu_ = -1;
+        int max_batch_bytes_ = 0;
+        int batch_linger_us_ = 0;
         bool conn_established_ = false;
         std::atomic_bool close_ = ATOMIC_VAR_INIT(false);
+        std::atomic_bool draining_ = ATOMIC_VAR_INIT(false);
+        std::atomic_bool going_away_ = ATOMIC_VAR_INIT(false);
+        int Serve();
+        bool WaitDrain(std::chrono::steady_clock::time_point deadline, std::function<bool(void)> done);
+
+        int listen_fd_ = -1;
+        int accept_wake_fd_ = -1;
+        std::thread accept_thread_;
+        std::mutex accept_mux_;
+        SyncDeque<int> adopt_fds_;
+        void AcceptLoop();
+        void StopAccept();
 
         SyncDeque<WebSocketFrameBuffer*> deque_receive_buf_empty_;
         SyncDeque<WebSocketFrameBuffer*> deque_receive_buf_full_;
         std::map<lws*, WebSocketFrameBuffer*> receive_buf_internal_;
         std::thread callback_thread_;
         void CallbackEventLoop();
+        void DispatchCallback(WebSocketFrameBuffer* buf);
+        void PostCallback(WebSocketFrameBuffer* buf);
+
+        bool external_loop_ = false;
+        WebSocketTracer tracer_;
+        WebSocketRecorder recorder_;
+        WebSocketPoller poller_;
 
         SyncDeque<WebSocketFrameBuffer*> deque_send_buf_empty_;
-        SyncDeque<WebSocketFrameBuffer*> deque_send_buf_full_;
+        struct ShmReader;
+        struct SendQueue {
+            std::deque<WebSocketFrameBuffer*> frames;
+            std::map<std::string, WebSocketFrameBuffer*> conflated;
+            int linger = 0;
+            std::shared_ptr<WebSocketShmChannel> shm;
+            // frames go over the websocket until the switch marker is written, then to the ring
+            WebSocketFrameBuffer* shm_marker = nullptr;
+            bool shm_active = false;
+            int shm_offset = 0;  // already written part of frames.front()
+            std::shared_ptr<ShmReader> shm_reader;
+            bool receive_paused = false;
+        };
+        std::map<lws*, SendQueue> send_queues_;
+        // connections whose receive_paused changed, applied on the service thread
+        std::set<lws*> receive_pause_changed_;
+        void ApplyReceivePause();
+        std::mutex send_mux_;
+        int SendFrame(int64_t user_id, uint8_t* data, int len, int type, const std::string& key = "");
+        int BroadcastFrame(uint8_t* data, int len, int type);
+        // send_mux_ held; 1 when the frame was queued and the connection needs a writable callback
+        int QueueFrame(lws* wsi, SendQueue& queue, uint8_t* data, int len, int type, const std::string& key);
+
+        std::function<void(int64_t user_id, int pending)> write_callback_;
+        std::vector<WebSocketFrameBuffer*> batch_frames_;
+        WebSocketFrameBuffer batch_buf_;
+        int WriteQueued(lws* wsi);
+        int WriteShm(SendQueue& queue);
+
+        // service thread only
+        struct ConnRateLimit {
+            TokenBucket msgs;
+            TokenBucket bytes;
+            bool throttled = false;
+        };
+        bool rate_limited_ = false;
+        double conn_msgs_per_sec_ = 0;
+        double conn_bytes_per_sec_ = 0;
+        std::shared_ptr<SharedRateLimit> global_limit_;
+        std::map<lws*, ConnRateLimit> rate_limits_;
+        std::atomic<int64_t> throttled_count_ = ATOMIC_VAR_INIT(0);
+        std::atomic_int throttled_connections_ = ATOMIC_VAR_INIT(0);
+        void ThrottleReceive(lws* wsi, int msgs, int bytes);
+        void ResumeReceive(lws* wsi);
+        void SetThrottleTimer(lws* wsi, int64_t wait_us);
+        void SetTimer(lws* wsi, int64_t delay_us);
+
+        bool local_transport_ = false;
+        // service thread only: asked for the ring in the handshake, and offered it awaiting the answer
+        std::set<lws*> shm_requested_;
+        std::set<lws*> shm_offered_;
+        void OfferLocalTransport(lws* wsi);
+        bool HandleLocalTransport(lws* wsi, WebSocketFrameBuffer* buf);
+        // ring input is admitted on the ring's reader thread and posted straight to the callback
+        // thread; an external loop picks it up from shm_receive_ after one wake per burst
+        struct ShmReader {
+            TokenBucket msgs;
+            TokenBucket bytes;
+            std::atomic_bool paused = ATOMIC_VAR_INIT(false);
+        };
+        SyncDeque<WebSocketFrameBuffer*> shm_receive_;
+        std::atomic_bool shm_wake_ = ATOMIC_VAR_INIT(false);
+        void ReceiveShm(ShmReader& reader, WebSocketShmChannel* shm, WebSocketFrameBuffer* buf);
+        void ThrottleShmReceive(ShmReader& reader, WebSocketShmChannel* shm, int bytes);
+        void DispatchShmReceive();
 
         int LwsClientCallback(lws* wsi, lws_callback_reasons reason, void* user, void* in, size_t len);
 
         std::mutex mux_;
         std::condition_variable cv_;
-        lws_context* context_;
+        lws_context* context_ = nullptr;
+        int CreateContext(int port);
+        void DestroyContext();
 
         static std::map<lws_context*, WebSocketServer*> server_ptr_;
         static std::mutex server_ptr_mux_;
@@ -0,0 +1,206 @@
+#include "WebSocketServerGroup.h"
+
+#include "logger.h"
+
+namespace poca_ws {
+    WebSocketServerGroup::WebSocketServerGroup(WebSocketServerListener& listener, int shard_num) {
+        if (shard_num < 1) shard_num = 1;
+        for (int i = 0; i < shard_num; ++i) {
+            shard_listeners_.push_back(new ShardListener(this, i, &listener));
+            shards_.push_back(new WebSocketServer(*shard_listeners_[i]));
+        }
+    }
+
+    WebSocketServerGroup::~WebSocketServerGroup() {
+        for (auto shard : shards_) {
+            delete shard;
+        }
+        for (auto shard_listener : shard_listeners_) {
+            delete shard_listener;
+        }
+    }
+
+    void WebSocketServerGroup::ShardListener::OnBinary(int64_t user_id, uint8_t* data, int len) {
+        listener_->OnBinary(user_id, data, len);
+    }
+
+    void WebSocketServerGroup::ShardListener::OnText(int64_t user_id, std::string& msg) {
+        listener_->OnText(user_id, msg);
+    }
+
+    void WebSocketServerGroup::ShardListener::OnConnect(int64_t user_id) {
+        {
+            std::unique_lock<std::shared_timed_mutex> lck(group_->user_mux_);
+            group_->user_shards_[user_id] = shard_;
+        }
+        listener_->OnConnect(user_id);
+    }
+
+    void WebSocketServerGroup::ShardListener::OnClose(int64_t user_id) {
+        {
+            // the user_id may already belong to a new connection on another shard
+            std::unique_lock<std::shared_timed_mutex> lck(group_->user_mux_);
+            auto it = group_->user_shards_.find(user_id);
+            if (it != group_->user_shards_.end() && it->second == shard_) {
+                group_->user_shards_.erase(it);
+            }
+        }
+        listener_->OnClose(user_id);
+    }
+
+    void WebSocketServerGroup::SetCpuSet(const std::vector<int>& cpus) { cpus_ = cpus; }
+
+    void WebSocketServerGroup::SetSendBatching(int max_batch_bytes, int linger_us) {
+        for (auto shard : shards_) {
+            shard->SetSendBatching(max_batch_bytes, linger_us);
+        }
+    }
+
+    void WebSocketServerGroup::SetRateLimit(double msgs_per_sec, double bytes_per_sec) {
+        for (auto shard : shards_) {
+            shard->SetRateLimit(msgs_per_sec, bytes_per_sec);
+        }
+    }
+
+    void WebSocketServerGroup::SetGlobalRateLimit(double msgs_per_sec, double bytes_per_sec) {
+        std::shared_ptr<SharedRateLimit> limit = std::make_shared<SharedRateLimit>(msgs_per_sec, bytes_per_sec);
+        for (auto shard : shards_) {
+            shard->SetGlobalRateLimit(limit);
+        }
+    }
+
+    int64_t WebSocketServerGroup::GetThrottledCount() {
+        int64_t count = 0;
+        for (auto shard : shards_) {
+            count += shard->GetThrottledCount();
+        }
+        return count;
+    }
+
+    int WebSocketServerGroup::GetThrottledConnections() {
+        int count = 0;
+        for (auto shard : shards_) {
+            count += shard->GetThrottledConnections();
+        }
+        return count;
+    }
+
+    void WebSocketServerGroup::SetTraceSampling(int one_in_n) {
+        for (auto shard : shards_) {
+            shard->SetTraceSampling(one_in_n);
+        }
+    }
+
+    int WebSocketServerGroup::GetShardNum() { return (int)shards_.size(); }
+
+    WebSocketTracer* WebSocketServerGroup::GetTracer(int shard) {
+        if (shard < 0 || shard >= (int)shards_.size()) return nullptr;
+        return shards_[shard]->GetTracer();
+    }
+
+    int WebSocketServerGroup::StartRecording(const std::string& path) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (shards_[i]->StartRecording(path + "." + std::to_string(i)) != 0) {
+                StopRecording();
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    void WebSocketServerGroup::StopRecording() {
+        for (auto shard : shards_) {
+            shard->StopRecording();
+        }
+    }
+
+    int WebSocketServerGroup::ListenAndServe(int port) {
+        std::vector<int> rets(shards_.size(), 0);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->SetReusePort(true);
+            if (!cpus_.empty()) {
+                shards_[i]->SetCpuAffinity(cpus_[i % cpus_.size()]);
+            }
+            shard_threads_.emplace_back([this, i, port, &rets]() {
+                rets[i] = shards_[i]->ListenAndServe(port);
+                if (rets[i] != 0) {
+                    poca_info("shard %d listen on port %d failed", (int)i, port);
+                    Close();
+                }
+            });
+        }
+        for (auto& t : shard_threads_) {
+            t.join();
+        }
+        shard_threads_.clear();
+        for (auto ret : rets) {
+            if (ret != 0) return -1;
+        }
+        return 0;
+    }
+
+    void WebSocketServerGroup::Close() {
+        for (auto shard : shards_) {
+            shard->Close();
+        }
+    }
+
+    int WebSocketServerGroup::Drain(int timeout_ms) {
+        std::vector<int> rets(shards_.size(), 0);
+        std::vector<std::thread> drain_threads;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            drain_threads.emplace_back([this, i, timeout_ms, &rets]() { rets[i] = shards_[i]->Drain(timeout_ms); });
+        }
+        for (auto& t : drain_threads) {
+            t.join();
+        }
+        for (auto ret : rets) {
+            if (ret != 0) return -1;
+        }
+        return 0;
+    }
+
+    WebSocketServer* WebSocketServerGroup::FindShard(int64_t user_id) {
+        std::shared_lock<std::shared_timed_mutex> lck(user_mux_);
+        auto it = user_shards_.find(user_id);
+        return it == user_shards_.end() ? nullptr : shards_[it->second];
+    }
+
+    int WebSocketServerGroup::SendMessage(int64_t user_id, std::string& msg) {
+        WebSocketServer* shard = FindShard(user_id);
+        if (shard == nullptr) return -1;
+        return shard->SendMessage(user_id, msg);
+    }
+
+    int WebSocketServerGroup::SendBinary(int64_t user_id, uint8_t* data, int len) {
+        WebSocketServer* shard = FindShard(user_id);
+        if (shard == nullptr) return -1;
+        return shard->SendBinary(user_id, data, len);
+    }
+
+    int WebSocketServerGroup::SendConflated(int64_t user_id, const std::string& key, std::string& msg) {
+        WebSocketServer* shard = FindShard(user_id);
+        if (shard == nullptr) return -1;
+        return shard->SendConflated(user_id, key, msg);
+    }
+
+    int WebSocketServerGroup::SendConflatedBinary(int64_t user_id, const std::string& key, uint8_t* data, int len) {
+        WebSocketServer* shard = FindShard(user_id);
+        if (shard == nullptr) return -1;
+        return shard->SendConflatedBinary(user_id, key, data, len);
+    }
+
+    int WebSocketServerGroup::Broadcast(std::string& msg) {
+        for (auto shard : shards_) {
+            shard->Broadcast(msg);
+        }
+        return 0;
+    }
+
+    int WebSocketServerGroup::BroadcastBinary(uint8_t* data, int len) {
+        for (auto shard : shards_) {
+            shard->BroadcastBinary(data, len);
+        }
+        return 0;
+    }
+}  // namespace poca_ws
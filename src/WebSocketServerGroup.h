@@ -0,0 +1,83 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_SERVER_GROUP_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_SERVER_GROUP_H
+
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "WebSocketServer.h"
+#include "WebSocketServerListener.h"
+
+namespace poca_ws {
+    // N independent WebSocketServer shards listening on the same port with SO_REUSEPORT,
+    // the kernel balances accepts between them. The listener is called from every shard's
+    // callback thread and must be thread safe.
+    class WebSocketServerGroup {
+    public:
+        WebSocketServerGroup(WebSocketServerListener& listener, int shard_num);
+        WebSocketServerGroup() = delete;
+        WebSocketServerGroup(const WebSocketServerGroup&) = delete;
+        WebSocketServerGroup& operator=(const WebSocketServerGroup&) = delete;
+        ~WebSocketServerGroup();
+
+        // shard i is pinned to cpus[i % cpus.size()], must be called before ListenAndServe
+        void SetCpuSet(const std::vector<int>& cpus);
+        void SetSendBatching(int max_batch_bytes, int linger_us = 0);
+        void SetRateLimit(double msgs_per_sec, double bytes_per_sec);
+        // one budget for the whole group, shared by the shards
+        void SetGlobalRateLimit(double msgs_per_sec, double bytes_per_sec);
+
+        int64_t GetThrottledCount();
+        int GetThrottledConnections();
+
+        void SetTraceSampling(int one_in_n);
+        int GetShardNum();
+        WebSocketTracer* GetTracer(int shard);
+
+        // every shard writes its own capture, path.<shard>, poca-ws-replay path merges them by ts_ns
+        int StartRecording(const std::string& path);
+        void StopRecording();
+
+        int ListenAndServe(int port);
+        void Close();
+        // drains every shard in parallel, see WebSocketServer::Drain
+        int Drain(int timeout_ms);
+
+        int SendMessage(int64_t user_id, std::string& msg);
+        int SendBinary(int64_t user_id, uint8_t* data, int len);
+        int SendConflated(int64_t user_id, const std::string& key, std::string& msg);
+        int SendConflatedBinary(int64_t user_id, const std::string& key, uint8_t* data, int len);
+        int Broadcast(std::string& msg);
+        int BroadcastBinary(uint8_t* data, int len);
+
+    private:
+        // records which shard owns a connection before the user's listener learns about it
+        class ShardListener final : public WebSocketServerListener {
+        public:
+            ShardListener(WebSocketServerGroup* group, int shard, WebSocketServerListener* listener)
+                : group_(group), shard_(shard), listener_(listener) {}
+
+            virtual void OnBinary(int64_t user_id, uint8_t* data, int len) override;
+            virtual void OnText(int64_t user_id, std::string& msg) override;
+            virtual void OnConnect(int64_t user_id) override;
+            virtual void OnClose(int64_t user_id) override;
+
+        private:
+            WebSocketServerGroup* group_;
+            int shard_;
+            WebSocketServerListener* listener_;
+        };
+
+        std::vector<WebSocketServer*> shards_;
+        std::vector<ShardListener*> shard_listeners_;
+        std::vector<std::thread> shard_threads_;
+        std::vector<int> cpus_;
+
+        std::shared_timed_mutex user_mux_;
+        std::map<int64_t, int> user_shards_;
+        WebSocketServer* FindShard(int64_t user_id);
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,238 @@
+#include "WebSocketShmChannel.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <ctime>
+
+#include "logger.h"
+
+#define SHM_RING_SIZE (4 << 20)
+#define SHM_MAX_CHUNK (SHM_RING_SIZE / 4)
+#define SHM_WRAP_MARK 0xffffffffu
+#define SHM_SEGMENT_MAGIC 0x504f4341u
+#define SHM_SPIN_COUNT 2000
+
+namespace poca_ws {
+    struct ShmRecordHeader {
+        uint32_t len;
+        uint16_t type;
+        uint16_t final;
+    };
+
+    struct ShmRing {
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> head_seq;
+        std::atomic<uint32_t> reader_waiting;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) uint8_t data[SHM_RING_SIZE];
+    };
+
+    struct ShmSegment {
+        uint32_t magic;
+        std::atomic<uint32_t> closed;
+        ShmRing rings[2];  // 0: server to client, 1: client to server
+    };
+
+    static std::atomic_int shm_name_seq = ATOMIC_VAR_INIT(0);
+
+    static uint64_t Align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+    static void FutexWait(std::atomic<uint32_t>* addr, uint32_t val, int timeout_ms) {
+        timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, val, &ts, nullptr, 0);
+    }
+
+    static void FutexWake(std::atomic<uint32_t>* addr) {
+        syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    WebSocketShmChannel::WebSocketShmChannel() {}
+
+    WebSocketShmChannel::~WebSocketShmChannel() {
+        Stop();
+        Unlink();
+        if (seg_ != nullptr) munmap(seg_, sizeof(ShmSegment));
+    }
+
+    int WebSocketShmChannel::Map(int fd, bool create) {
+        if (create && ftruncate(fd, sizeof(ShmSegment)) != 0) {
+            close(fd);
+            return -1;
+        }
+        void* addr = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            poca_info("mmap shm segment %s failed", name_.c_str());
+            return -1;
+        }
+        seg_ = (ShmSegment*)addr;
+        return 0;
+    }
+
+    int WebSocketShmChannel::Create(std::string& name) {
+        name_ = "/poca-ws-" + std::to_string(getpid()) + "-" + std::to_string(shm_name_seq.fetch_add(1));
+        int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            poca_info("shm_open %s failed", name_.c_str());
+            name_.clear();
+            return -1;
+        }
+        if (Map(fd, true) != 0) {
+            Unlink();
+            return -1;
+        }
+        // a fresh segment is zero filled, which is the empty state of both rings
+        seg_->magic = SHM_SEGMENT_MAGIC;
+        is_server_ = true;
+        name = name_;
+        return 0;
+    }
+
+    int WebSocketShmChannel::Attach(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            poca_info("shm_open %s failed", name.c_str());
+            return -1;
+        }
+        if (Map(fd, false) != 0) return -1;
+        if (seg_->magic != SHM_SEGMENT_MAGIC) {
+            munmap(seg_, sizeof(ShmSegment));
+            seg_ = nullptr;
+            return -1;
+        }
+        is_server_ = false;
+        return 0;
+    }
+
+    void WebSocketShmChannel::Unlink() {
+        if (is_server_ && !name_.empty()) {
+            shm_unlink(name_.c_str());
+            name_.clear();
+        }
+    }
+
+    bool WebSocketShmChannel::IsClosed() { return seg_ == nullptr || seg_->closed.load() != 0; }
+
+    int WebSocketShmChannel::Write(int type, uint8_t* data, int len, int& offset) {
+        std::unique_lock<std::mutex> lck(write_mux_);
+        if (seg_ == nullptr || seg_->closed.load()) return -1;
+        ShmRing& ring = seg_->rings[is_server_ ? 0 : 1];
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        do {
+            int chunk = len - offset < SHM_MAX_CHUNK ? len - offset : SHM_MAX_CHUNK;
+            uint64_t need = Align8(sizeof(ShmRecordHeader) + chunk);
+            uint64_t pos = head % SHM_RING_SIZE;
+            uint64_t wrap = pos + need > SHM_RING_SIZE ? SHM_RING_SIZE - pos : 0;
+            if (SHM_RING_SIZE - (head - ring.tail.load(std::memory_order_acquire)) < wrap + need) {
+                return SHM_RING_FULL;
+            }
+            if (wrap > 0) {
+                ShmRecordHeader mark = {SHM_WRAP_MARK, 0, 0};
+                memcpy(ring.data + pos, &mark, sizeof(mark));
+                head += wrap;
+                pos = 0;
+            }
+            ShmRecordHeader header = {(uint32_t)chunk, (uint16_t)type, (uint16_t)(offset + chunk == len)};
+            memcpy(ring.data + pos, &header, sizeof(header));
+            if (chunk > 0) memcpy(ring.data + pos + sizeof(header), data + offset, chunk);
+            head += need;
+            offset += chunk;
+            ring.head.store(head, std::memory_order_release);
+            ring.head_seq.fetch_add(1);
+            if (ring.reader_waiting.load()) FutexWake(&ring.head_seq);
+        } while (offset < len);
+        return 0;
+    }
+
+    int64_t WebSocketShmChannel::GetPendingBytes() {
+        if (seg_ == nullptr) return 0;
+        ShmRing& ring = seg_->rings[is_server_ ? 0 : 1];
+        return (int64_t)(ring.head.load(std::memory_order_acquire) - ring.tail.load(std::memory_order_acquire));
+    }
+
+    void WebSocketShmChannel::Start(std::function<void(int type, uint8_t* data, int len)> handler) {
+        reader_thread_ = std::thread(&WebSocketShmChannel::ReadLoop, this, handler);
+    }
+
+    static void UnpinReader() {
+        // a creator pinned to one cpu, e.g. a shard's service thread, keeps it; the spinning reader
+        // takes every other cpu instead of competing with it
+        cpu_set_t cpu_set;
+        if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0 || CPU_COUNT(&cpu_set) != 1) {
+            return;
+        }
+        int nprocs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nprocs < 2) return;
+        cpu_set_t others;
+        CPU_ZERO(&others);
+        for (int cpu = 0; cpu < nprocs && cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &cpu_set)) CPU_SET(cpu, &others);
+        }
+        // the kernel narrows the mask to the cpuset the process may use
+        if (pthread_setaffinity_np(pthread_self(), sizeof(others), &others) != 0) {
+            poca_info("unpin shm reader failed");
+        }
+    }
+
+    void WebSocketShmChannel::ReadLoop(std::function<void(int type, uint8_t* data, int len)> handler) {
+        UnpinReader();
+        ShmRing& ring = seg_->rings[is_server_ ? 1 : 0];
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        int spin = 0;
+        while (true) {
+            // loaded before head: everything the peer wrote before shutting down is visible
+            bool closed = seg_->closed.load(std::memory_order_acquire) != 0;
+            if (ring.head.load(std::memory_order_acquire) == tail) {
+                if (closed) break;
+                if (++spin < SHM_SPIN_COUNT) continue;
+                uint32_t seq = ring.head_seq.load();
+                ring.reader_waiting.store(1);
+                if (ring.head.load() == tail && !seg_->closed.load()) {
+                    FutexWait(&ring.head_seq, seq, 100);
+                }
+                ring.reader_waiting.store(0);
+                continue;
+            }
+            spin = 0;
+            uint64_t pos = tail % SHM_RING_SIZE;
+            ShmRecordHeader header;
+            memcpy(&header, ring.data + pos, sizeof(header));
+            if (header.len == SHM_WRAP_MARK) {
+                tail += SHM_RING_SIZE - pos;
+            } else if (header.final && read_buf_.GetLength() == 0) {
+                // single chunk message, handed over straight from the ring
+                handler(header.type, ring.data + pos + sizeof(header), header.len);
+                tail += Align8(sizeof(header) + header.len);
+            } else {
+                read_buf_.Push(ring.data + pos + sizeof(header), header.len);
+                tail += Align8(sizeof(header) + header.len);
+                if (header.final) {
+                    handler(header.type, read_buf_.GetPtr(), read_buf_.GetLength());
+                    read_buf_.Clear();
+                }
+            }
+            ring.tail.store(tail, std::memory_order_release);
+        }
+    }
+
+    void WebSocketShmChannel::Shutdown() {
+        if (seg_ == nullptr) return;
+        seg_->closed.store(1);
+        for (auto& ring : seg_->rings) {
+            ring.head_seq.fetch_add(1);
+            FutexWake(&ring.head_seq);
+        }
+    }
+
+    void WebSocketShmChannel::Stop() {
+        Shutdown();
+        if (reader_thread_.joinable()) reader_thread_.join();
+    }
+}  // namespace poca_ws
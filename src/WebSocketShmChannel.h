@@ -0,0 +1,70 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_SHM_CHANNEL_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_SHM_CHANNEL_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "WebSocketFrameBuffer.h"
+
+// first bytes of the in band negotiation messages, never a valid text frame from a peer
+#define SHM_OFFER_MAGIC "\x01poca-shm-offer:"
+#define SHM_ACK_MAGIC "\x01poca-shm-ack"
+#define SHM_NACK_MAGIC "\x01poca-shm-nack"
+#define SHM_SWITCH_MAGIC "\x01poca-shm-switch"
+#define SHM_REQUEST_HEADER "x-poca-shm:"
+
+#define SHM_RING_FULL 1
+// how often a sender with a backlog retries a full ring
+#define SHM_RETRY_US 1000
+
+namespace poca_ws {
+    struct ShmSegment;
+
+    // A pair of single producer single consumer rings in a POSIX shared memory segment, one per
+    // direction, with futex wakeups for the reader. The server creates the segment and sends its
+    // name over the websocket, the client attaches to it. Messages larger than a ring chunk are
+    // split. Writers never block, a message the ring cannot take is resumed from its offset later.
+    class WebSocketShmChannel {
+    public:
+        WebSocketShmChannel();
+        WebSocketShmChannel(const WebSocketShmChannel&) = delete;
+        WebSocketShmChannel& operator=(const WebSocketShmChannel&) = delete;
+        ~WebSocketShmChannel();
+
+        int Create(std::string& name);
+        int Attach(const std::string& name);
+        // drop the name once the peer has attached
+        void Unlink();
+
+        // writes chunks of data from offset on and advances it. 0 once the message is complete,
+        // SHM_RING_FULL when the ring ran out of room, -1 once the channel is shut down
+        int Write(int type, uint8_t* data, int len, int& offset);
+        // bytes written to the peer's ring that it has not consumed yet
+        int64_t GetPendingBytes();
+
+        // reads the peer's ring on a dedicated thread until Stop. Messages already in the ring
+        // when the channel is shut down are still handed over before the thread exits. The thread
+        // does not run on the cpu its creator is pinned to. A handler that takes its time leaves
+        // messages in the ring, so the peer's backlog builds up as on a paused socket
+        void Start(std::function<void(int type, uint8_t* data, int len)> handler);
+        void Shutdown();
+        void Stop();
+        bool IsClosed();
+
+    private:
+        ShmSegment* seg_ = nullptr;
+        bool is_server_ = false;
+        std::string name_;
+        std::mutex write_mux_;
+        std::thread reader_thread_;
+        WebSocketFrameBuffer read_buf_;
+
+        int Map(int fd, bool create);
+        void ReadLoop(std::function<void(int type, uint8_t* data, int len)> handler);
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,142 @@
+#include "WebSocketTracer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "logger.h"
+
+#define MAX_TRACE_RECORDS 10000
+
+namespace poca_ws {
+    static const char* trace_stage_names[TraceStageNum] = {
+        "receive", "enqueue", "dequeue", "callback_start", "callback_end", "send_enqueue", "write",
+    };
+
+    WebSocketTracer::WebSocketTracer() { memset(histograms_, 0, sizeof(histograms_)); }
+
+    WebSocketTracer::~WebSocketTracer() {}
+
+    int64_t WebSocketTracer::NowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    const char* WebSocketTracer::GetStageName(int stage) {
+        if (stage < 0 || stage >= TraceStageNum) return "";
+        return trace_stage_names[stage];
+    }
+
+    void WebSocketTracer::SetSampleRate(int one_in_n) { sample_rate_.store(one_in_n > 0 ? one_in_n : 0); }
+
+    bool WebSocketTracer::Enabled() { return sample_rate_.load(std::memory_order_relaxed) > 0; }
+
+    bool WebSocketTracer::Sample() {
+        int rate = sample_rate_.load(std::memory_order_relaxed);
+        if (rate <= 0) return false;
+        return sample_seq_.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+    }
+
+    void WebSocketTracer::Stamp(WebSocketFrameBuffer* buf, int stage) {
+        if (buf->IsTraced()) buf->SetTraceStamp(stage, NowNs());
+    }
+
+    void WebSocketTracer::Record(WebSocketFrameBuffer* buf) {
+        if (!buf->IsTraced()) return;
+        TraceRecord record;
+        record.user_id = buf->GetUserId();
+        for (int stage = 0; stage < TraceStageNum; ++stage) {
+            record.stamps[stage] = buf->GetTraceStamp(stage);
+        }
+
+        std::unique_lock<std::mutex> lck(mux_);
+        int64_t prev = 0;
+        for (int stage = 0; stage < TraceStageNum; ++stage) {
+            int64_t stamp = record.stamps[stage];
+            if (stamp == 0) continue;
+            if (prev != 0) {
+                uint64_t delta = stamp > prev ? stamp - prev : 0;
+                int bucket = 0;
+                while (delta > 1 && bucket < TRACE_HISTOGRAM_BUCKETS - 1) {
+                    delta >>= 1;
+                    bucket++;
+                }
+                histograms_[stage][bucket]++;
+            }
+            prev = stamp;
+        }
+        records_.push_back(record);
+        if (records_.size() > MAX_TRACE_RECORDS) {
+            records_.pop_front();
+        }
+    }
+
+    int64_t WebSocketTracer::GetCount(int stage) {
+        if (stage < 0 || stage >= TraceStageNum) return 0;
+        std::unique_lock<std::mutex> lck(mux_);
+        int64_t count = 0;
+        for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+            count += histograms_[stage][i];
+        }
+        return count;
+    }
+
+    int64_t WebSocketTracer::GetPercentile(int stage, double percentile) {
+        if (stage < 0 || stage >= TraceStageNum) return 0;
+        std::unique_lock<std::mutex> lck(mux_);
+        int64_t count = 0;
+        for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+            count += histograms_[stage][i];
+        }
+        if (count == 0) return 0;
+        int64_t target = (int64_t)(count * percentile / 100.0);
+        int64_t seen = 0;
+        for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+            seen += histograms_[stage][i];
+            if (seen > target || seen == count) {
+                return i >= 62 ? INT64_MAX : (int64_t(1) << (i + 1)) - 1;
+            }
+        }
+        return INT64_MAX;
+    }
+
+    int WebSocketTracer::ExportChromeTrace(const std::string& path) {
+        FILE* fp = fopen(path.c_str(), "w");
+        if (fp == nullptr) {
+            poca_info("open trace file %s failed", path.c_str());
+            return -1;
+        }
+        std::unique_lock<std::mutex> lck(mux_);
+        fprintf(fp, "{\"traceEvents\":[");
+        bool first = true;
+        for (auto& record : records_) {
+            int64_t prev = 0;
+            int prev_stage = 0;
+            for (int stage = 0; stage < TraceStageNum; ++stage) {
+                int64_t stamp = record.stamps[stage];
+                if (stamp == 0) continue;
+                if (prev != 0) {
+                    // one complete event per span, named after the stages it connects
+                    fprintf(fp,
+                            "%s\n{\"name\":\"%s->%s\",\"cat\":\"poca_ws\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                            "\"pid\":1,\"tid\":%lld}",
+                            first ? "" : ",", trace_stage_names[prev_stage], trace_stage_names[stage], prev / 1000.0,
+                            (stamp - prev) / 1000.0, (long long)record.user_id);
+                    first = false;
+                }
+                prev = stamp;
+                prev_stage = stage;
+            }
+        }
+        fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+        fclose(fp);
+        return 0;
+    }
+
+    void WebSocketTracer::Reset() {
+        std::unique_lock<std::mutex> lck(mux_);
+        memset(histograms_, 0, sizeof(histograms_));
+        records_.clear();
+    }
+}  // namespace poca_ws
@@ -0,0 +1,55 @@
+#ifndef POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_TRACER_H
+#define POCA_WEBSOCKET_CPP_SRC_WEB_SOCKET_TRACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "WebSocketFrameBuffer.h"
+
+#define TRACE_HISTOGRAM_BUCKETS 64
+
+namespace poca_ws {
+    // Sampled per message latency through the server pipeline. Each stage histogram holds the time
+    // spent between the previous stamped stage and this one, in log2 nanosecond buckets.
+    class WebSocketTracer {
+    public:
+        WebSocketTracer();
+        WebSocketTracer(const WebSocketTracer&) = delete;
+        WebSocketTracer& operator=(const WebSocketTracer&) = delete;
+        ~WebSocketTracer();
+
+        // trace one message in every one_in_n, 0 disables tracing
+        void SetSampleRate(int one_in_n);
+        bool Enabled();
+        bool Sample();
+        void Stamp(WebSocketFrameBuffer* buf, int stage);
+        void Record(WebSocketFrameBuffer* buf);
+
+        int64_t GetCount(int stage);
+        // upper bound in ns of the bucket holding the given percentile (0-100)
+        int64_t GetPercentile(int stage, double percentile);
+        static const char* GetStageName(int stage);
+
+        int ExportChromeTrace(const std::string& path);
+        void Reset();
+
+        static int64_t NowNs();
+
+    private:
+        struct TraceRecord {
+            int64_t user_id;
+            int64_t stamps[TraceStageNum];
+        };
+
+        std::atomic_int sample_rate_ = ATOMIC_VAR_INIT(0);
+        std::atomic<uint64_t> sample_seq_ = ATOMIC_VAR_INIT(0);
+
+        std::mutex mux_;
+        int64_t histograms_[TraceStageNum][TRACE_HISTOGRAM_BUCKETS];
+        std::deque<TraceRecord> records_;
+    };
+}  // namespace poca_ws
+#endif
@@ -0,0 +1,134 @@
+#include "listen_socket.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "logger.h"
+
+namespace PocaSocket {
+    static int FillUnixAddr(const std::string &unix_path, sockaddr_un &addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (unix_path.size() >= sizeof(addr.sun_path)) {
+            poca_info("unix path too long: %s", unix_path.c_str());
+            return -1;
+        }
+        strncpy(addr.sun_path, unix_path.c_str(), sizeof(addr.sun_path) - 1);
+        return 0;
+    }
+
+    int CreateListenSocket(int port, int backlog, bool reuse_port) {
+        bool ipv6 = true;
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd < 0 && errno == EAFNOSUPPORT) {
+            // ipv6 disabled on the host, listen on ipv4 only
+            ipv6 = false;
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        }
+        if (fd < 0) {
+            poca_info("create listen socket failed");
+            return -1;
+        }
+        int on = 1, off = 0;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (reuse_port) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        }
+        sockaddr_storage addr;
+        socklen_t addr_len;
+        memset(&addr, 0, sizeof(addr));
+        if (ipv6) {
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            sockaddr_in6 *addr6 = (sockaddr_in6 *)&addr;
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_addr = in6addr_any;
+            addr6->sin6_port = htons(port);
+            addr_len = sizeof(sockaddr_in6);
+        } else {
+            sockaddr_in *addr4 = (sockaddr_in *)&addr;
+            addr4->sin_family = AF_INET;
+            addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+            addr4->sin_port = htons(port);
+            addr_len = sizeof(sockaddr_in);
+        }
+        if (bind(fd, (sockaddr *)&addr, addr_len) != 0 || listen(fd, backlog) != 0) {
+            poca_info("listen on port %d failed", port);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int ReceiveListenSocket(const std::string &unix_path) {
+        sockaddr_un addr;
+        if (FillUnixAddr(unix_path, addr) != 0) return -1;
+        int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (server_fd < 0) return -1;
+        unlink(unix_path.c_str());
+        if (bind(server_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(server_fd, 1) != 0) {
+            poca_info("listen on %s failed", unix_path.c_str());
+            close(server_fd);
+            return -1;
+        }
+        int conn_fd = accept4(server_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        close(server_fd);
+        unlink(unix_path.c_str());
+        if (conn_fd < 0) return -1;
+
+        char data;
+        iovec iov = {&data, 1};
+        char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        int listen_fd = -1;
+        if (recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC) > 0) {
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        close(conn_fd);
+        if (listen_fd < 0) poca_info("no socket received on %s", unix_path.c_str());
+        return listen_fd;
+    }
+
+    int SendListenSocket(int listen_fd, const std::string &unix_path) {
+        sockaddr_un addr;
+        if (FillUnixAddr(unix_path, addr) != 0) return -1;
+        int conn_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (conn_fd < 0) return -1;
+        if (connect(conn_fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+            poca_info("connect to %s failed", unix_path.c_str());
+            close(conn_fd);
+            return -1;
+        }
+
+        char data = 0;
+        iovec iov = {&data, 1};
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+        int ret = sendmsg(conn_fd, &msg, 0) == 1 ? 0 : -1;
+        close(conn_fd);
+        return ret;
+    }
+}  // namespace PocaSocket
@@ -0,0 +1,16 @@
+#ifndef POCA_WEBSOCKET_CPP_UTIL_LISTEN_SOCKET_H
+#define POCA_WEBSOCKET_CPP_UTIL_LISTEN_SOCKET_H
+
+#include <string>
+
+// Helpers to hand a listening socket from a draining process to its replacement over a unix
+// domain socket (SCM_RIGHTS), so the port never stops accepting during a restart.
+namespace PocaSocket {
+    // non blocking, every process sharing it must accept with EAGAIN in mind
+    int CreateListenSocket(int port, int backlog = 1024, bool reuse_port = false);
+    // blocks until a peer connects to unix_path and passes a socket
+    int ReceiveListenSocket(const std::string &unix_path);
+    int SendListenSocket(int listen_fd, const std::string &unix_path);
+}  // namespace PocaSocket
+
+#endif
@@ -35,6 +35,15 @@ public:
         return true;
     }
 
+    bool PeekNoWait(T& t) {
+        std::unique_lock<std::mutex> lock(mux_);
+        if (que_.empty()) {
+            return false;
+        }
+        t = que_.front();
+        return true;
+    }
+
     int GetSize() {
         std::unique_lock<std::mutex> lock(mux_);
         return que_.size();
@@ -0,0 +1,82 @@
+#ifndef POCA_WEBSOCKET_CPP_UTIL_TOKEN_BUCKET_H
+#define POCA_WEBSOCKET_CPP_UTIL_TOKEN_BUCKET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
+// Not thread safe. Consume may drive the bucket into debt, the caller is expected to back off
+// for the returned time instead of dropping what it already has.
+class TokenBucket {
+public:
+    void Init(double rate, double burst) {
+        rate_ = rate;
+        burst_ = burst > 0 ? burst : rate;
+        tokens_ = burst_;
+        last_us_ = -1;
+    }
+
+    bool Enabled() { return rate_ > 0; }
+
+    // returns microseconds until the bucket is out of debt, 0 if it is not in debt
+    int64_t Consume(double n, int64_t now_us) {
+        if (!Enabled()) return 0;
+        Refill(now_us);
+        tokens_ -= n;
+        return WaitUs();
+    }
+
+    int64_t WaitUs(int64_t now_us) {
+        if (!Enabled()) return 0;
+        Refill(now_us);
+        return WaitUs();
+    }
+
+private:
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    int64_t last_us_ = -1;
+
+    void Refill(int64_t now_us) {
+        if (last_us_ >= 0 && now_us > last_us_) {
+            tokens_ += (now_us - last_us_) * rate_ / 1000000.0;
+            if (tokens_ > burst_) tokens_ = burst_;
+        }
+        last_us_ = now_us;
+    }
+
+    int64_t WaitUs() {
+        if (tokens_ >= 0) return 0;
+        return (int64_t)(-tokens_ * 1000000.0 / rate_) + 1;
+    }
+};
+
+// Message and byte buckets consumed from several threads, e.g. one budget for every shard of a
+// server group. Rates are fixed at construction.
+class SharedRateLimit {
+public:
+    SharedRateLimit(double msgs_per_sec, double bytes_per_sec) {
+        msgs_.Init(msgs_per_sec, msgs_per_sec);
+        bytes_.Init(bytes_per_sec, bytes_per_sec);
+    }
+
+    bool Enabled() { return msgs_.Enabled() || bytes_.Enabled(); }
+
+    int64_t Consume(double msgs, double bytes, int64_t now_us) {
+        std::unique_lock<std::mutex> lck(mux_);
+        return std::max(msgs_.Consume(msgs, now_us), bytes_.Consume(bytes, now_us));
+    }
+
+    int64_t WaitUs(int64_t now_us) {
+        std::unique_lock<std::mutex> lck(mux_);
+        return std::max(msgs_.WaitUs(now_us), bytes_.WaitUs(now_us));
+    }
+
+private:
+    std::mutex mux_;
+    TokenBucket msgs_;
+    TokenBucket bytes_;
+};
+
+#endif